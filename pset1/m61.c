@@ -6,14 +6,43 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 // To check for wild writes
 #define default_head 1234
 #define default_foot 4321
 
+// Byte written over every freed payload while it sits in quarantine
+#define poison_byte 0xDB
+
+// Default byte budget for the freed-block quarantine. Can be overridden
+// with the M61_QUARANTINE environment variable (0 disables it).
+#define quarantine_default (1 << 20)
+
 // Default size for hash table for hhtest
 #define table_size 1000
 
+// Number of power-of-two size buckets in the allocation histograms.
+// Bucket 0 holds zero-byte allocations, bucket i holds sizes in
+// [2^(i-1), 2^i), and the last bucket holds everything larger.
+#define hist_buckets 32
+
+// Allocations of up to slab_max_size bytes are carved out of slabs of
+// slab_slots equal-size slots. Size classes are 16, 32, ... 256 bytes.
+#define slab_slots 64
+#define slab_classes 5
+#define slab_max_size (16 << (slab_classes - 1))
+
 // Static struct to keep track of stats
 static struct m61_statistics total_stats = {
     0, 0, 0, 0, 0, 0, NULL, NULL
@@ -27,21 +56,53 @@ typedef struct heavy_stats {
   const char *file;
   int line;
   unsigned long long allocs;
+  uint32_t id;              // index in the call-site table of m61_dump
 } heavy_stats;
 
 struct heavy_stats* hash_table[table_size];
 
-// Meta structure to keep track of info about each dynamic allocation
+// Allocation size histograms. Plain counters so malloc and free stay
+// lock-free; the snapshot thread reads them without synchronization.
+static unsigned long long hist_total[hist_buckets];
+static unsigned long long hist_active[hist_buckets];
+
+// State for the background snapshot writer. The signal handler and
+// m61_stopsnapshots talk to the thread through snapshot_pipe.
+static pthread_t snapshot_thread;
+static int snapshot_pipe[2] = {-1, -1};
+static int snapshot_fd = -1;
+static unsigned snapshot_interval;
+static int snapshot_signo;
+static struct sigaction snapshot_oldaction;
+
+// Meta structure to keep track of info about each dynamic allocation.
+// Blocks in a slab are tracked by the slab's bitmaps and never linked
+// into the root list, so their next/prev stay NULL.
 typedef struct m61_meta {
     int header;
-    size_t size;
     bool is_active;
+    size_t size;
     const char *file;
     int line;
     struct m61_meta *next;
     struct m61_meta *prev;
+    struct m61_slab *slab;
 } m61_meta;
 
+// Descriptor for a slab of slab_slots small blocks. Descriptors live on
+// their own cache lines in pages mapped outside the heap, so malloc and
+// free of a small block only set or clear a bit here instead of touching
+// neighboring blocks, and wild writes around the blocks can't reach the
+// bitmaps. `used` marks slots that are active or quarantined, `live`
+// only the active ones.
+typedef struct m61_slab {
+    uint64_t live;
+    uint64_t used;
+    struct m61_slab *next;
+    char *slots;
+    size_t stride;
+} __attribute__((aligned(64))) m61_slab;
+
 // Footer to check for wild writes/boundary problems
 typedef struct m61_foot {
     int footer;
@@ -50,6 +111,26 @@ typedef struct m61_foot {
 // Pointer to keep track of memory leaks
 struct m61_meta *root;
 
+// Slabs for each small size class, newest first
+static m61_slab *slabs[slab_classes];
+
+// Unused descriptors left in the most recently mapped descriptor page
+static m61_slab *slab_pool;
+static size_t slab_pool_left;
+
+// FIFO of freed blocks that have not been handed back to malloc yet,
+// kept as a ring of quarantine_count pointers starting at
+// quarantine_ring[quarantine_first]. The ring lives apart from the
+// blocks, so queueing a block never touches another block's metadata.
+// It has room for quarantine_cap pointers and doubles when full.
+// quarantine_bytes counts payload bytes held.
+static m61_meta **quarantine_ring;
+static size_t quarantine_cap;
+static size_t quarantine_first;
+static size_t quarantine_count;
+static size_t quarantine_bytes;
+static size_t quarantine_budget = (size_t) -1;
+
 // Function to find padding to make sure all memory is aligned
 // to double word size based on size of meta structure.
 size_t find_pad(void) {
@@ -59,6 +140,90 @@ size_t find_pad(void) {
         return sizeof(m61_meta) % sizeof(long long);
 }
 
+// Function to return the meta structure of slot `i` in `slab`.
+static m61_meta* slot_meta(m61_slab* slab, unsigned i) {
+    return (m61_meta*) (slab->slots + i * slab->stride + find_pad());
+}
+
+// Function to find the active slab block that a given ptr is within by
+// scanning the slabs' live bitmaps.
+static m61_meta* find_slab_meta(void* ptr) {
+    for (int c = 0; c < slab_classes; c++) {
+        for (m61_slab* slab = slabs[c]; slab; slab = slab->next) {
+            char* end = slab->slots + slab_slots * slab->stride;
+            if ((char*) ptr < slab->slots || (char*) ptr >= end)
+                continue;
+            unsigned i = ((char*) ptr - slab->slots) / slab->stride;
+            m61_meta* meta = slot_meta(slab, i);
+            if ((slab->live >> i) & 1
+                && (char*) (meta + 1) <= (char*) ptr
+                && (char*) ptr <= (char*) (meta + 1) + meta->size)
+                return meta;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// Function to check that `meta` really is the active block in the slab
+// slot it claims, which catches frees of copied or stale metadata.
+static bool slab_block_active(m61_meta* meta) {
+    m61_slab* slab = meta->slab;
+    size_t off = (char*) meta - find_pad() - slab->slots;
+    unsigned i = off / slab->stride;
+    return off % slab->stride == 0 && i < slab_slots
+        && ((slab->live >> i) & 1);
+}
+
+// Function to take a free slot from a slab of size class `c`, making a
+// new slab if every slab of that class is full. Returns the start of
+// the slot or NULL if out of memory.
+static char* slab_alloc(int c, m61_slab** slabp) {
+    m61_slab* slab = slabs[c];
+    while (slab && slab->used == ~(uint64_t) 0)
+        slab = slab->next;
+    if (!slab) {
+        size_t stride = find_pad() + sizeof(m61_meta) + (16 << c)
+            + sizeof(m61_foot);
+        stride = (stride + 15) & ~(size_t) 15;
+        if (!slab_pool_left) {
+            void* page = mmap(NULL, 4096, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (page == MAP_FAILED)
+                return NULL;
+            slab_pool = (m61_slab*) page;
+            slab_pool_left = 4096 / sizeof(m61_slab);
+        }
+        char* slots = (char*) malloc(slab_slots * stride);
+        if (!slots)
+            return NULL;
+        slab = slab_pool++;
+        slab_pool_left--;
+        slab->slots = slots;
+        slab->live = slab->used = 0;
+        slab->stride = stride;
+        slab->next = slabs[c];
+        slabs[c] = slab;
+    }
+    unsigned i = __builtin_ctzll(~slab->used);
+    slab->used |= (uint64_t) 1 << i;
+    slab->live |= (uint64_t) 1 << i;
+    *slabp = slab;
+    return slab->slots + i * slab->stride;
+}
+
+// Function to give a block's memory back: clear its slab slot or return
+// it to malloc.
+static void release_block(m61_meta* meta) {
+    if (meta->slab) {
+        unsigned i = ((char*) meta - find_pad() - meta->slab->slots)
+            / meta->slab->stride;
+        meta->slab->used &= ~((uint64_t) 1 << i);
+    } else {
+        free((char*) meta - find_pad());
+    }
+}
+
 // Function to find the block of allocated memory that a given ptr is
 // within and return the pointer to the meta data of that structure by
 // using our root pointer.
@@ -87,9 +252,30 @@ int hash(int key)
   return key;
 }
 
+// Function to find the histogram bucket for an allocation of sz bytes.
+static int size_bucket(size_t sz) {
+    if (sz == 0)
+        return 0;
+    int bucket = 8 * sizeof(unsigned long) - __builtin_clzl(sz);
+    return bucket < hist_buckets ? bucket : hist_buckets - 1;
+}
+
+// Function to find the hash_table bucket for a file-line pair
+static unsigned heavy_index(const char* file, int line) {
+  int key = (int) (uintptr_t) file + line;
+  return (unsigned) hash(key) % table_size;
+}
+
+// Function to find the heavy_stats entry for a file-line pair
+static heavy_stats* find_heavy(const char* file, int line) {
+  heavy_stats* curr = hash_table[heavy_index(file, line)];
+  while (curr && (curr->file != file || curr->line != line))
+    curr = curr->next;
+  return curr;
+}
+
 void fill_heavy(m61_meta* meta) { 
-  int key = (int) meta->file + meta->line;
-  int index = hash(key) % table_size;
+  unsigned index = heavy_index(meta->file, meta->line);
   if (!hash_table[index]) {
     hash_table[index] = (heavy_stats*) malloc(sizeof(heavy_stats));
     hash_table[index]->size = meta->size;
@@ -124,6 +310,123 @@ void fill_heavy(m61_meta* meta) {
   curr->allocs++;
 }
 
+// Returns the offset of the first byte in [data, data + sz) that is not
+// poison_byte, or sz if the whole range is still poisoned. Compares 64
+// bytes per iteration so the check costs about the same as the memset
+// that poisoned the block.
+static size_t find_unpoisoned(const unsigned char* data, size_t sz) {
+    size_t i = 0;
+#if defined(__SSE2__)
+    const __m128i poison = _mm_set1_epi8((char) poison_byte);
+    for (; i + 64 <= sz; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*) (data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*) (data + i + 48));
+        __m128i eq = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, poison),
+                                                 _mm_cmpeq_epi8(b, poison)),
+                                   _mm_and_si128(_mm_cmpeq_epi8(c, poison),
+                                                 _mm_cmpeq_epi8(d, poison)));
+        if (_mm_movemask_epi8(eq) != 0xFFFF)
+            break;
+    }
+    for (; i + 16 <= sz; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, poison)) ^ 0xFFFF;
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#else
+    // No SSE2: compare a machine word at a time
+    unsigned long poison_word;
+    memset(&poison_word, poison_byte, sizeof(poison_word));
+    for (; i + sizeof(unsigned long) <= sz; i += sizeof(unsigned long)) {
+        unsigned long w;
+        memcpy(&w, data + i, sizeof(w));
+        if (w != poison_word)
+            break;
+    }
+#endif
+    for (; i < sz; i++) {
+        if (data[i] != poison_byte)
+            return i;
+    }
+    return sz;
+}
+
+// Function to check a block leaving the quarantine for writes that
+// happened after it was freed, then release its memory.
+static void release_quarantined(m61_meta* meta) {
+    unsigned char* payload = (unsigned char*) (meta + 1);
+    m61_foot *foot = (m61_foot*) (payload + meta->size);
+    size_t offset = find_unpoisoned(payload, meta->size);
+
+    if (meta->header != default_head || meta->is_active
+        || foot->footer != default_foot) {
+        printf("MEMORY BUG: %s:%d: detected wild write to freed pointer %p\n",
+               meta->file, meta->line, payload);
+    }
+    else if (offset != meta->size) {
+        printf("MEMORY BUG: %s:%d: detected use after free of pointer %p\n",
+               meta->file, meta->line, payload);
+        printf("  %p is %zu bytes inside a %zu byte region freed here\n",
+               payload + offset, offset, meta->size);
+    }
+    release_block(meta);
+}
+
+// Function to take the oldest block out of the quarantine, check it and
+// release it.
+static void release_oldest(void) {
+    m61_meta* oldest = quarantine_ring[quarantine_first];
+    quarantine_first = (quarantine_first + 1) % quarantine_cap;
+    quarantine_count--;
+    quarantine_bytes -= oldest->size;
+    release_quarantined(oldest);
+}
+
+// Function to poison a freed block and put it at the back of the
+// quarantine, releasing the oldest blocks once over budget. meta->file
+// and meta->line are switched to the free site so reports point there.
+static void quarantine_block(m61_meta* meta, const char* file, int line) {
+    if (quarantine_budget == (size_t) -1) {
+        const char* env = getenv("M61_QUARANTINE");
+        quarantine_budget = env ? strtoul(env, NULL, 0) : quarantine_default;
+    }
+
+    meta->file = file;
+    meta->line = line;
+    // Too big to hold: check nothing, release right away
+    if (meta->size > quarantine_budget) {
+        release_block(meta);
+        return;
+    }
+
+    // Grow the ring, unwrapping it; if that fails, don't hold the block
+    if (quarantine_count == quarantine_cap) {
+        size_t cap = quarantine_cap ? 2 * quarantine_cap : 256;
+        m61_meta** ring = (m61_meta**) malloc(cap * sizeof(m61_meta*));
+        if (!ring) {
+            release_block(meta);
+            return;
+        }
+        for (size_t i = 0; i < quarantine_count; i++)
+            ring[i] = quarantine_ring[(quarantine_first + i) % quarantine_cap];
+        free(quarantine_ring);
+        quarantine_ring = ring;
+        quarantine_cap = cap;
+        quarantine_first = 0;
+    }
+
+    memset(meta + 1, poison_byte, meta->size);
+    quarantine_ring[(quarantine_first + quarantine_count) % quarantine_cap] = meta;
+    quarantine_count++;
+    quarantine_bytes += meta->size;
+
+    while (quarantine_bytes > quarantine_budget)
+        release_oldest();
+}
+
 void* m61_malloc(size_t sz, const char* file, int line) {
     (void) file, (void) line;   // avoid uninitialized variable warnings
     
@@ -137,7 +440,17 @@ void* m61_malloc(size_t sz, const char* file, int line) {
         return NULL;
     }
     
-    char *ptr = malloc(new_sz);
+    // Small blocks come from a slab slot, everything else from malloc
+    m61_slab *slab = NULL;
+    char *ptr;
+    if (sz <= slab_max_size) {
+        int c = 0;
+        while ((16 << c) < (int) sz)
+            c++;
+        ptr = slab_alloc(c, &slab);
+    } else {
+        ptr = malloc(new_sz);
+    }
     
     if (!ptr) {
 
@@ -167,18 +480,20 @@ void* m61_malloc(size_t sz, const char* file, int line) {
         meta->next = NULL;
         meta->file = file;
         meta->line = line;
+        meta->slab = slab;
         
         m61_foot *foot = (m61_foot*) (ptr + pad + sizeof(m61_meta) + sz);
         
         foot->footer = default_foot;
         
-	// This adds meta to our linked list of active allocated memory
-        if(!root){
+	// This adds meta to our linked list of active allocated memory;
+	// slab blocks are already tracked by their slab's live bitmap
+        if(!slab && !root){
             root = meta;
             root->next = NULL;
             root->prev = NULL;
         }
-        else {
+        else if (!slab) {
             root->next = meta;
             meta->prev = root;
             root = meta;
@@ -188,6 +503,8 @@ void* m61_malloc(size_t sz, const char* file, int line) {
         total_stats.nactive++;
         total_stats.total_size += sz;
         total_stats.active_size += sz;
+        hist_total[size_bucket(sz)]++;
+        hist_active[size_bucket(sz)]++;
 	fill_heavy(meta);
 	
 	// Return ptr to the payload requested
@@ -219,6 +536,9 @@ void m61_free(void *ptr, const char *file, int line) {
       // Use find_meta to find closest meta structure where ptr is within
       // that meta structures block
       m61_meta* found_ptr = find_meta(ptr, root);
+      if (!found_ptr) {
+          found_ptr = find_slab_meta(ptr);
+      }
       if (!found_ptr) {  
           printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not allocated\n", 
 		   file, line, ptr);
@@ -238,7 +558,8 @@ void m61_free(void *ptr, const char *file, int line) {
         printf("MEMORY BUG: %s:%d: detected wild write during free of pointer %p\n",
 	         file, line, ptr);
     }
-    else if (meta->prev && meta->prev->next != meta) {
+    else if ((meta->prev && meta->prev->next != meta)
+             || (meta->slab && !slab_block_active(meta))) {
         printf("MEMORY BUG: %s:%d: invalid free of pointer %p, not allocated\n", 
 	         file, line, ptr);
     }
@@ -246,6 +567,7 @@ void m61_free(void *ptr, const char *file, int line) {
     
         total_stats.nactive--;
         total_stats.active_size -= meta->size;
+        hist_active[size_bucket(meta->size)]--;
         meta->is_active = false;
 	// Update heap min and max
         if((char*)meta < total_stats.heap_min) {
@@ -254,8 +576,14 @@ void m61_free(void *ptr, const char *file, int line) {
         if((char*)ptr + meta->size > total_stats.heap_max) {
             total_stats.heap_max = (char*) meta->prev; 
         }
-	// Remove meta pointer from our linked list
-        if(root == meta) {
+	// Remove meta pointer from our linked list, or for a slab block
+	// just clear its live bit
+        if (meta->slab) {
+            unsigned i = ((char*) meta - find_pad() - meta->slab->slots)
+                / meta->slab->stride;
+            meta->slab->live &= ~((uint64_t) 1 << i);
+        }
+        else if(root == meta) {
             if(root->prev == NULL) {
                 root = NULL;
             }
@@ -272,12 +600,9 @@ void m61_free(void *ptr, const char *file, int line) {
                 meta->prev->next = meta->next;
             }
         }
-	// free new_ptr which is the begining of our originally allocated
-	// block of memory
-        size_t pad = find_pad();
-        void* new_ptr = ptr - sizeof(m61_meta) - pad;
-        
-        free(new_ptr);
+	// Poison the block and hold it in quarantine; it is freed for real
+	// once newer frees push it out
+        quarantine_block(meta, file, line);
     }
 }
 
@@ -330,6 +655,162 @@ void m61_getstatistics(struct m61_statistics* stats) {
     *stats = total_stats;
 }
 
+// Function to format a histogram as a JSON array at `buf`.
+static int format_hist(char* buf, size_t sz, const unsigned long long* hist) {
+    int len = snprintf(buf, sz, "[");
+    for (int i = 0; i < hist_buckets && (size_t) len < sz; i++)
+        len += snprintf(buf + len, sz - len, "%s%llu", i ? "," : "", hist[i]);
+    if ((size_t) len < sz)
+        len += snprintf(buf + len, sz - len, "]");
+    return len;
+}
+
+// m61_writesnapshot(fd)
+//    Write the current statistics and size histograms to `fd` as one
+//    line of JSON. Uses only a stack buffer and write(), so it is safe to
+//    call from the snapshot thread while other threads allocate.
+
+void m61_writesnapshot(int fd) {
+    struct m61_statistics stats;
+    m61_getstatistics(&stats);
+    unsigned long long total[hist_buckets], active[hist_buckets];
+    memcpy(total, hist_total, sizeof(total));
+    memcpy(active, hist_active, sizeof(active));
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    char buf[2048];
+    int len = snprintf(buf, sizeof(buf),
+                       "{\"time\":%ld.%06ld, \"nactive\":%llu, \"active_size\":%llu, "
+                       "\"ntotal\":%llu, \"total_size\":%llu, \"nfail\":%llu, "
+                       "\"fail_size\":%llu, \"heap_min\":\"%p\", \"heap_max\":\"%p\", "
+                       "\"hist_total\":",
+                       (long) now.tv_sec, now.tv_nsec / 1000,
+                       stats.nactive, stats.active_size, stats.ntotal,
+                       stats.total_size, stats.nfail, stats.fail_size,
+                       stats.heap_min, stats.heap_max);
+    len += format_hist(buf + len, sizeof(buf) - len, total);
+    len += snprintf(buf + len, sizeof(buf) - len, ", \"hist_active\":");
+    len += format_hist(buf + len, sizeof(buf) - len, active);
+    len += snprintf(buf + len, sizeof(buf) - len, "}\n");
+    assert((size_t) len < sizeof(buf));
+
+    for (int off = 0; off < len; ) {
+        ssize_t w = write(fd, buf + off, len - off);
+        if (w < 0 && errno != EINTR)
+            return;
+        if (w > 0)
+            off += w;
+    }
+}
+
+// Signal handler: wake the snapshot thread through the self-pipe.
+static void snapshot_signal(int signo) {
+    (void) signo;
+    int saved_errno = errno;
+    ssize_t w = write(snapshot_pipe[1], "s", 1);
+    (void) w;
+    errno = saved_errno;
+}
+
+// Snapshot thread: write a snapshot every snapshot_interval seconds and
+// whenever the signal handler pokes the pipe; exit on a 'q' byte.
+static void* snapshot_main(void* arg) {
+    (void) arg;
+    int timeout = snapshot_interval ? (int) snapshot_interval * 1000 : -1;
+    struct pollfd pfd = { snapshot_pipe[0], POLLIN, 0 };
+    while (1) {
+        int r = poll(&pfd, 1, timeout);
+        if (r == 0) {
+            m61_writesnapshot(snapshot_fd);
+            continue;
+        } else if (r < 0) {
+            continue;
+        }
+        char cmds[64];
+        ssize_t n = read(snapshot_pipe[0], cmds, sizeof(cmds));
+        for (ssize_t i = 0; i < n; i++) {
+            if (cmds[i] == 'q')
+                return NULL;
+            m61_writesnapshot(snapshot_fd);
+        }
+    }
+}
+
+// Function to make the self-pipe. Both ends are non-blocking, so a
+// signal arriving while the pipe is full drops its (redundant) wakeup
+// instead of blocking the interrupted thread, and close-on-exec.
+static int snapshot_openpipe(void) {
+    if (pipe(snapshot_pipe) < 0)
+        return -1;
+    for (int i = 0; i < 2; i++) {
+        int fl = fcntl(snapshot_pipe[i], F_GETFL);
+        if (fl < 0 || fcntl(snapshot_pipe[i], F_SETFL, fl | O_NONBLOCK) < 0
+            || fcntl(snapshot_pipe[i], F_SETFD, FD_CLOEXEC) < 0) {
+            close(snapshot_pipe[0]);
+            close(snapshot_pipe[1]);
+            snapshot_pipe[0] = snapshot_pipe[1] = -1;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// m61_startsnapshots(fd, interval, signo)
+//    Start a background thread that writes m61_writesnapshot(fd) lines
+//    every `interval` seconds (never if 0) and whenever signal `signo`
+//    arrives (not at all if 0). Returns 0 on success, -1 on error or if
+//    snapshots are already running.
+
+int m61_startsnapshots(int fd, unsigned interval, int signo) {
+    if (snapshot_fd >= 0 || snapshot_openpipe() < 0)
+        return -1;
+    snapshot_fd = fd;
+    snapshot_interval = interval;
+    snapshot_signo = signo;
+    if (signo) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = snapshot_signal;
+        sa.sa_flags = SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        sigaction(signo, &sa, &snapshot_oldaction);
+    }
+    if (pthread_create(&snapshot_thread, NULL, snapshot_main, NULL) != 0) {
+        if (signo)
+            sigaction(signo, &snapshot_oldaction, NULL);
+        close(snapshot_pipe[0]);
+        close(snapshot_pipe[1]);
+        snapshot_pipe[0] = snapshot_pipe[1] = -1;
+        snapshot_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// m61_stopsnapshots()
+//    Stop the snapshot thread after it writes any snapshots already
+//    requested by signals, and restore the old signal handler.
+
+void m61_stopsnapshots(void) {
+    if (snapshot_fd < 0)
+        return;
+    if (snapshot_signo)
+        sigaction(snapshot_signo, &snapshot_oldaction, NULL);
+    // The thread drains the pipe, so wait for room if it is full
+    struct pollfd pfd = { snapshot_pipe[1], POLLOUT, 0 };
+    ssize_t w;
+    while ((w = write(snapshot_pipe[1], "q", 1)) < 0
+           && (errno == EINTR || errno == EAGAIN))
+        poll(&pfd, 1, -1);
+    if (w == 1)
+        pthread_join(snapshot_thread, NULL);
+    close(snapshot_pipe[0]);
+    close(snapshot_pipe[1]);
+    snapshot_pipe[0] = snapshot_pipe[1] = -1;
+    snapshot_fd = -1;
+}
+
 void m61_printstatistics(void) {
     struct m61_statistics stats;
     m61_getstatistics(&stats);
@@ -341,12 +822,128 @@ void m61_printstatistics(void) {
 }
 
 void m61_printleakreport(void) {
+    // Blocks still in quarantine get checked for use after free too
+    while (quarantine_count)
+        release_oldest();
+
     m61_meta* meta = root;
     while(meta) {
         printf("LEAK CHECK: %s:%d: allocated object %p with size %zu\n", 
 	       meta->file, meta->line, meta + 1, meta->size);
         meta = meta->prev;
     }
+    // Small blocks: walk each slab's live bitmap one set bit at a time
+    for (int c = 0; c < slab_classes; c++) {
+        for (m61_slab* slab = slabs[c]; slab; slab = slab->next) {
+            for (uint64_t live = slab->live; live; live &= live - 1) {
+                meta = slot_meta(slab, __builtin_ctzll(live));
+                printf("LEAK CHECK: %s:%d: allocated object %p with size %zu\n",
+                       meta->file, meta->line, meta + 1, meta->size);
+            }
+        }
+    }
+}
+
+// Buffer for m61_dump: records are staged here and written out in
+// large sequential chunks.
+typedef struct dump_buffer {
+    int fd;
+    size_t len;
+    bool failed;
+    char data[1 << 16];
+} dump_buffer;
+
+// Function to write out everything staged in the dump buffer.
+static void dump_flush(dump_buffer* db) {
+    size_t off = 0;
+    while (off < db->len && !db->failed) {
+        ssize_t w = write(db->fd, db->data + off, db->len - off);
+        if (w > 0)
+            off += w;
+        else if (w < 0 && errno != EINTR)
+            db->failed = true;
+    }
+    db->len = 0;
+}
+
+// Function to append `sz` bytes to the dump, writing full chunks.
+static void dump_append(dump_buffer* db, const void* data, size_t sz) {
+    const char* p = (const char*) data;
+    while (sz > 0) {
+        size_t n = sizeof(db->data) - db->len;
+        if (n > sz)
+            n = sz;
+        memcpy(db->data + db->len, p, n);
+        db->len += n;
+        p += n;
+        sz -= n;
+        if (db->len == sizeof(db->data))
+            dump_flush(db);
+    }
+}
+
+// Function to append one active block's record to the dump.
+static void dump_block(dump_buffer* db, m61_meta* meta) {
+    struct m61_dump_block rec;
+    heavy_stats* site = find_heavy(meta->file, meta->line);
+    rec.addr = (uintptr_t) (meta + 1);
+    rec.size = meta->size;
+    rec.site = site ? site->id : UINT32_MAX;
+    rec.pad = 0;
+    dump_append(db, &rec, sizeof(rec));
+}
+
+// m61_dump(path)
+//    Write a binary snapshot of every active allocation (address, size,
+//    call site) and the call-site table to `path`, in the format
+//    described in m61.h. Returns 0 on success and -1 on error.
+
+int m61_dump(const char* path) {
+    dump_buffer* db = (dump_buffer*) malloc(sizeof(dump_buffer));
+    if (!db)
+        return -1;
+    db->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    db->len = 0;
+    db->failed = db->fd < 0;
+
+    // Number the call sites first so block records can refer to them
+    uint32_t nsites = 0;
+    for (int i = 0; i < table_size; i++)
+        for (heavy_stats* curr = hash_table[i]; curr; curr = curr->next)
+            curr->id = nsites++;
+
+    struct m61_dump_header hdr;
+    hdr.magic = M61_DUMP_MAGIC;
+    hdr.version = M61_DUMP_VERSION;
+    hdr.nsites = nsites;
+    hdr.nblocks = total_stats.nactive;
+    hdr.time = time(NULL);
+    dump_append(db, &hdr, sizeof(hdr));
+
+    for (int i = 0; i < table_size; i++) {
+        for (heavy_stats* curr = hash_table[i]; curr; curr = curr->next) {
+            struct m61_dump_site site;
+            site.line = curr->line;
+            site.namelen = strlen(curr->file);
+            dump_append(db, &site, sizeof(site));
+            dump_append(db, curr->file, site.namelen);
+        }
+    }
+
+    // Active blocks: the large-block list, then each slab's live bitmap
+    for (m61_meta* meta = root; meta; meta = meta->prev)
+        dump_block(db, meta);
+    for (int c = 0; c < slab_classes; c++)
+        for (m61_slab* slab = slabs[c]; slab; slab = slab->next)
+            for (uint64_t live = slab->live; live; live &= live - 1)
+                dump_block(db, slot_meta(slab, __builtin_ctzll(live)));
+
+    dump_flush(db);
+    int r = db->failed ? -1 : 0;
+    if (db->fd >= 0 && close(db->fd) < 0)
+        r = -1;
+    free(db);
+    return r;
 }
 
 void m61_printheavyreport(void) {
@@ -1,6 +1,7 @@
 #ifndef M61_H
 #define M61_H 1
 #include <stdlib.h>
+#include <stdint.h>
 
 void* m61_malloc(size_t sz, const char* file, int line);
 void m61_free(void* ptr, const char* file, int line);
@@ -23,6 +24,40 @@ void m61_printstatistics(void);
 void m61_printleakreport(void);
 void m61_printheavyreport(void);
 
+void m61_writesnapshot(int fd);
+int m61_startsnapshots(int fd, unsigned interval, int signo);
+void m61_stopsnapshots(void);
+
+int m61_dump(const char* path);
+
+// Heap dump format written by m61_dump() and read by m61diff, in host
+// byte order: one m61_dump_header, then `nsites` call sites (each an
+// m61_dump_site followed by `namelen` bytes of file name), then
+// `nblocks` m61_dump_block records. A block's `site` indexes the call
+// site list.
+#define M61_DUMP_MAGIC 0x4436314DU      // "M61D" in little-endian order
+#define M61_DUMP_VERSION 1
+
+struct m61_dump_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t nsites;
+    uint64_t nblocks;
+    uint64_t time;                      // seconds since the epoch
+};
+
+struct m61_dump_site {
+    uint32_t line;
+    uint32_t namelen;
+};
+
+struct m61_dump_block {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t site;
+    uint32_t pad;
+};
+
 #if !M61_DISABLE
 #define malloc(sz)              m61_malloc((sz), __FILE__, __LINE__)
 #define free(ptr)               m61_free((ptr), __FILE__, __LINE__)
@@ -0,0 +1,183 @@
+#define M61_DISABLE 1
+#include "m61.h"
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Usage: ./m61diff [-n COUNT] OLDDUMP NEWDUMP
+//    Compares two heap dumps written by m61_dump() and prints the call
+//    sites whose active bytes changed, largest growth first. Prints at
+//    most COUNT sites (default 20; 0 means all).
+
+// Active bytes and objects of one call site in one dump
+typedef struct site_usage {
+    char* name;                 // "file:line"
+    int which;                  // 0 for the old dump, 1 for the new one
+    uint64_t bytes;
+    uint64_t count;
+} site_usage;
+
+// One call site's change between the two dumps
+typedef struct site_growth {
+    const char* name;
+    uint64_t bytes[2];
+    uint64_t count[2];
+} site_growth;
+
+typedef struct heap_dump {
+    struct m61_dump_header hdr;
+    site_usage* sites;
+} heap_dump;
+
+// Function to read all of `filename` into a malloc'd buffer.
+static char* read_file(const char* filename, size_t* size) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    size_t cap = 1 << 16, len = 0;
+    char* data = (char*) malloc(cap);
+    ssize_t n;
+    while (data && (n = read(fd, data + len, cap - len)) > 0) {
+        len += n;
+        if (len == cap)
+            data = (char*) realloc(data, cap *= 2);
+    }
+    close(fd);
+    *size = len;
+    return data;
+}
+
+// Function to load a dump and total its blocks by call site. Returns
+// 0 on success and -1 if the file is missing or malformed.
+static int load_dump(const char* filename, int which, heap_dump* dump) {
+    size_t size;
+    uint64_t i = 0;
+    dump->sites = NULL;
+    char* data = read_file(filename, &size);
+    if (!data || size < sizeof(dump->hdr))
+        goto error;
+    memcpy(&dump->hdr, data, sizeof(dump->hdr));
+    if (dump->hdr.magic != M61_DUMP_MAGIC
+        || dump->hdr.version != M61_DUMP_VERSION)
+        goto error;
+
+    // Every site takes at least a record, so a larger count is corrupt
+    size_t off = sizeof(dump->hdr);
+    if (dump->hdr.nsites > (size - off) / sizeof(struct m61_dump_site))
+        goto error;
+    dump->sites = (site_usage*) calloc(dump->hdr.nsites + 1, sizeof(site_usage));
+    if (!dump->sites)
+        goto error;
+    for (; i < dump->hdr.nsites; i++) {
+        struct m61_dump_site site;
+        if (off + sizeof(site) > size)
+            goto error;
+        memcpy(&site, data + off, sizeof(site));
+        off += sizeof(site);
+        if (site.namelen > size - off)
+            goto error;
+        char* name = (char*) malloc((size_t) site.namelen + 16);
+        if (!name)
+            goto error;
+        sprintf(name, "%.*s:%u", (int) site.namelen, data + off, site.line);
+        off += site.namelen;
+        dump->sites[i].name = name;
+        dump->sites[i].which = which;
+    }
+    // Blocks whose call site is unknown are charged to a catch-all
+    dump->sites[i].name = strdup("(unknown)");
+    if (!dump->sites[i].name)
+        goto error;
+    dump->sites[i].which = which;
+
+    for (uint64_t b = 0; b < dump->hdr.nblocks; b++) {
+        struct m61_dump_block rec;
+        if (off + sizeof(rec) > size)
+            goto error;
+        memcpy(&rec, data + off, sizeof(rec));
+        off += sizeof(rec);
+        uint64_t s = rec.site < dump->hdr.nsites ? rec.site : dump->hdr.nsites;
+        dump->sites[s].bytes += rec.size;
+        dump->sites[s].count++;
+    }
+    free(data);
+    return 0;
+
+ error:
+    if (dump->sites)
+        for (uint64_t j = 0; j <= i; j++)
+            free(dump->sites[j].name);
+    free(dump->sites);
+    free(data);
+    return -1;
+}
+
+static int compare_name(const void* a, const void* b) {
+    return strcmp(((const site_usage*) a)->name, ((const site_usage*) b)->name);
+}
+
+static int compare_growth(const void* a, const void* b) {
+    const site_growth* x = (const site_growth*) a;
+    const site_growth* y = (const site_growth*) b;
+    int64_t gx = (int64_t) (x->bytes[1] - x->bytes[0]);
+    int64_t gy = (int64_t) (y->bytes[1] - y->bytes[0]);
+    if (gx != gy)
+        return gx < gy ? 1 : -1;
+    return strcmp(x->name, y->name);
+}
+
+int main(int argc, char** argv) {
+    // Parse arguments
+    size_t limit = 20;
+    if (argc >= 3 && strcmp(argv[1], "-n") == 0) {
+        limit = strtoul(argv[2], 0, 0);
+        argc -= 2, argv += 2;
+    }
+    if (argc != 3) {
+        fprintf(stderr, "Usage: m61diff [-n COUNT] OLDDUMP NEWDUMP\n");
+        exit(1);
+    }
+
+    heap_dump dumps[2];
+    for (int i = 0; i < 2; i++) {
+        if (load_dump(argv[i + 1], i, &dumps[i]) < 0) {
+            fprintf(stderr, "m61diff: %s: not a valid m61 heap dump\n", argv[i + 1]);
+            exit(1);
+        }
+    }
+
+    // Sort both dumps' call sites together by name, then merge equal names
+    size_t n0 = dumps[0].hdr.nsites + 1, n1 = dumps[1].hdr.nsites + 1;
+    site_usage* all = (site_usage*) malloc((n0 + n1) * sizeof(site_usage));
+    memcpy(all, dumps[0].sites, n0 * sizeof(site_usage));
+    memcpy(all + n0, dumps[1].sites, n1 * sizeof(site_usage));
+    qsort(all, n0 + n1, sizeof(site_usage), compare_name);
+
+    site_growth* growth = (site_growth*) calloc(n0 + n1, sizeof(site_growth));
+    size_t ngrowth = 0;
+    uint64_t total[2] = {0, 0};
+    for (size_t i = 0; i < n0 + n1; i++) {
+        if (ngrowth == 0 || strcmp(growth[ngrowth - 1].name, all[i].name) != 0)
+            growth[ngrowth++].name = all[i].name;
+        growth[ngrowth - 1].bytes[all[i].which] += all[i].bytes;
+        growth[ngrowth - 1].count[all[i].which] += all[i].count;
+        total[all[i].which] += all[i].bytes;
+    }
+    qsort(growth, ngrowth, sizeof(site_growth), compare_growth);
+
+    printf("m61diff: %" PRIu64 " -> %" PRIu64 " active bytes (%+" PRId64 ") over %" PRId64 "s\n",
+           total[0], total[1], (int64_t) (total[1] - total[0]),
+           (int64_t) (dumps[1].hdr.time - dumps[0].hdr.time));
+    size_t nprinted = 0;
+    for (size_t i = 0; i < ngrowth && (limit == 0 || nprinted < limit); i++) {
+        site_growth* g = &growth[i];
+        if (g->bytes[0] == g->bytes[1] && g->count[0] == g->count[1])
+            continue;
+        printf("GROWTH: %s: %+" PRId64 " bytes, %+" PRId64 " objects (%" PRIu64 " -> %" PRIu64 " bytes)\n",
+               g->name, (int64_t) (g->bytes[1] - g->bytes[0]),
+               (int64_t) (g->count[1] - g->count[0]), g->bytes[0], g->bytes[1]);
+        nprinted++;
+    }
+}
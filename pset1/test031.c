@@ -0,0 +1,22 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Use after free detected when the block leaves the quarantine.
+
+int main() {
+    char* ptr = (char*) malloc(100);
+    free(ptr);
+    ptr[40] = 'x';
+    // Push the freed block out of the quarantine
+    for (int i = 0; i < 20; ++i) {
+        void* big = malloc(100000);
+        free(big);
+    }
+    m61_printstatistics();
+}
+
+//! MEMORY BUG: test???.c:9: detected use after free of pointer ???
+//!   ??? is 40 bytes inside a 100 byte region freed here
+//! malloc count: active          0   total         21   fail          0
+//! malloc size:  active          0   total    2000100   fail          0
@@ -0,0 +1,21 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+// Statistics snapshot written by the snapshot thread on a signal.
+
+int main() {
+    void* a = malloc(1);
+    void* b = malloc(100);
+    void* c = malloc(5000);
+    free(b);
+    int r = m61_startsnapshots(STDOUT_FILENO, 0, SIGUSR1);
+    assert(r == 0);
+    raise(SIGUSR1);
+    m61_stopsnapshots();
+    (void) a, (void) c;
+}
+
+//! {"time":???, "nactive":2, "active_size":5001, "ntotal":3, "total_size":5101, "nfail":0, "fail_size":0, "heap_min":"???", "heap_max":"???", "hist_total":[0,1,0,0,0,0,0,1,0,0,0,0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0], "hist_active":[0,1,0,0,0,0,0,0,0,0,0,0,0,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0]}
@@ -0,0 +1,21 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Advanced error message for freeing data inside a small (slab) block.
+
+int main() {
+    void* ptrs[100];
+    for (int i = 0; i < 100; ++i)
+        ptrs[i] = malloc(24);
+    free((char*) ptrs[70] + 10);
+    for (int i = 0; i < 100; ++i)
+        if (i % 10 != 3)
+            free(ptrs[i]);
+    m61_printstatistics();
+}
+
+//! MEMORY BUG: test???.c:11: invalid free of pointer ???, not allocated
+//!   test???.c:10: ??? is 10 bytes inside a 24 byte region allocated here
+//! malloc count: active         10   total        100   fail          0
+//! malloc size:  active        240   total       2400   fail          0
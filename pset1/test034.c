@@ -0,0 +1,46 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Heap dump contains every active block and the call-site table.
+
+int main() {
+    void* ptrs[100];
+    for (int i = 0; i < 100; ++i)
+        ptrs[i] = malloc(i % 2 ? 16 : 1000);
+    for (int i = 0; i < 100; i += 4)
+        free(ptrs[i]);
+    int r = m61_dump("out/test034.dump");
+    assert(r == 0);
+
+    FILE* f = fopen("out/test034.dump", "r");
+    assert(f);
+    struct m61_dump_header hdr;
+    size_t n = fread(&hdr, sizeof(hdr), 1, f);
+    assert(n == 1 && hdr.magic == M61_DUMP_MAGIC);
+    printf("sites %llu, blocks %llu\n", (unsigned long long) hdr.nsites,
+           (unsigned long long) hdr.nblocks);
+    for (unsigned long long i = 0; i < hdr.nsites; ++i) {
+        struct m61_dump_site site;
+        char name[100];
+        n = fread(&site, sizeof(site), 1, f);
+        assert(n == 1 && site.namelen < sizeof(name));
+        n = fread(name, 1, site.namelen, f);
+        printf("site %.*s:%u\n", (int) site.namelen, name, site.line);
+    }
+    unsigned long long total = 0;
+    struct m61_dump_block rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        assert(rec.site == 0);
+        total += rec.size;
+    }
+    fclose(f);
+    printf("dumped bytes %llu\n", total);
+    m61_printstatistics();
+}
+
+//! sites 1, blocks 75
+//! site test???.c:10
+//! dumped bytes 25800
+//! malloc count: active         75   total        100   fail          0
+//! malloc size:  active      25800   total      50800   fail          0
@@ -0,0 +1,18 @@
+#include "m61.h"
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+// Use after free of a block still in the quarantine, detected by the
+// leak report.
+
+int main() {
+    char* ptr = (char*) malloc(100);
+    free(ptr);
+    ptr[10] = 'x';
+    m61_printleakreport();
+    printf("OK\n");
+}
+
+//! MEMORY BUG: test???.c:10: detected use after free of pointer ???
+//!   ??? is 10 bytes inside a 100 byte region freed here
+//! OK
@@ -0,0 +1,44 @@
+#include "m61.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+// m61diff reports per-site growth between two dumps and rejects a
+// truncated dump.
+
+int main() {
+    for (int i = 0; i < 10; ++i)
+        (void) malloc(100);
+    int r = m61_dump("out/test036a.dump");
+    assert(r == 0);
+    for (int i = 0; i < 5; ++i)
+        (void) malloc(1000);
+    (void) malloc(24);
+    r = m61_dump("out/test036b.dump");
+    assert(r == 0);
+
+    // Copy the second dump minus its last few bytes
+    FILE* in = fopen("out/test036b.dump", "r");
+    FILE* out = fopen("out/test036c.dump", "w");
+    assert(in && out);
+    char buf[8192];
+    size_t n = fread(buf, 1, sizeof(buf), in);
+    assert(n > 10 && n < sizeof(buf));
+    fwrite(buf, 1, n - 10, out);
+    fclose(in);
+    fclose(out);
+
+    fflush(stdout);
+    r = system("./m61diff out/test036a.dump out/test036b.dump");
+    printf("status %d\n", r);
+    fflush(stdout);
+    r = system("./m61diff out/test036a.dump out/test036c.dump");
+    printf("status %d\n", r != 0);
+}
+
+//! m61diff: 1000 -> 6024 active bytes (+5024) over ???s
+//! GROWTH: test???.c:15: +5000 bytes, +5 objects (0 -> 5000 bytes)
+//! GROWTH: test???.c:16: +24 bytes, +1 objects (0 -> 24 bytes)
+//! status 0
+//! m61diff: out/test036c.dump: not a valid m61 heap dump
+//! status 1
@@ -1,15 +1,28 @@
 #include "io61.h"
 
-// Usage: ./blockcat61 [-b BLOCKSIZE] [FILE]
+// Usage: ./blockcat61 [-b BLOCKSIZE] [-k] [-c] [FILE]
 //    Copies the input FILE to standard output in blocks.
-//    Default BLOCKSIZE is 4096.
+//    Default BLOCKSIZE is 4096. With -k, each block is copied with
+//    io61_copy. With -c, both files keep checksums, and a line with the
+//    CRC32C of the data is appended to the output if they agree.
 
 int main(int argc, char** argv) {
     // Parse arguments
     size_t blocksize = 4096;
-    if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
-        blocksize = strtoul(argv[2], 0, 0);
-        argc -= 2, argv += 2;
+    int use_copy = 0;
+    int checksum = 0;
+    while (argc >= 2) {
+        if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+            blocksize = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-k") == 0) {
+            use_copy = 1;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-c") == 0) {
+            checksum = 1;
+            --argc, ++argv;
+        } else
+            break;
     }
 
     // Allocate buffer, open files
@@ -20,13 +33,34 @@ int main(int argc, char** argv) {
     io61_profile_begin();
     io61_file* inf = io61_open_check(in_filename, O_RDONLY);
     io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+    if (checksum) {
+        io61_setchecksum(inf, 1);
+        io61_setchecksum(outf, 1);
+    }
 
     // Copy file data
     while (1) {
-        ssize_t amount = io61_read(inf, buf, blocksize);
+        ssize_t amount;
+        if (use_copy)
+            amount = io61_copy(inf, outf, blocksize);
+        else {
+            amount = io61_read(inf, buf, blocksize);
+            if (amount > 0)
+                io61_write(outf, buf, amount);
+        }
         if (amount <= 0)
             break;
-        io61_write(outf, buf, amount);
+    }
+
+    if (checksum) {
+        uint32_t crc = io61_checksum(inf);
+        if (io61_checksum(outf) != crc) {
+            fprintf(stderr, "blockcat61: checksums differ\n");
+            exit(1);
+        }
+        char line[100];
+        int n = snprintf(line, sizeof(line), "blockcat61: crc32c %08x\n", (unsigned) crc);
+        io61_write(outf, line, n);
     }
 
     io61_close(inf);
@@ -0,0 +1,73 @@
+#include "io61.h"
+
+// Usage: ./borrowcat61 [-b BLOCKSIZE] [-c] [FILE]
+//    Copies the input FILE to standard output without copying it into a
+//    buffer of its own: it borrows up to BLOCKSIZE bytes at a time with
+//    io61_borrow (default 4096), writes the first half of them, and
+//    releases just those, so the rest is lent again. Every 16th step
+//    reads a character with io61_readc instead. With -c, both files keep
+//    checksums, and a line with the CRC32C of the data is appended to
+//    the output if they agree.
+
+int main(int argc, char** argv) {
+    // Parse arguments
+    size_t blocksize = 4096;
+    int checksum = 0;
+    while (argc >= 2) {
+        if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+            blocksize = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-c") == 0) {
+            checksum = 1;
+            --argc, ++argv;
+        } else
+            break;
+    }
+    assert(blocksize > 0);
+
+    // Open files
+    const char* in_filename = argc >= 2 ? argv[1] : NULL;
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(in_filename, O_RDONLY);
+    io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+    if (checksum) {
+        io61_setchecksum(inf, 1);
+        io61_setchecksum(outf, 1);
+    }
+
+    // Copy file data
+    for (unsigned long step = 1; ; ++step) {
+        if (step % 16 == 0) {
+            int ch = io61_readc(inf);
+            if (ch == EOF)
+                break;
+            io61_writec(outf, ch);
+            continue;
+        }
+        const char* data;
+        ssize_t amount = io61_borrow(inf, &data, blocksize);
+        if (amount <= 0)
+            break;
+        size_t n = (amount + 1) / 2;
+        io61_write(outf, data, n);
+        if (io61_release(inf, n) < 0) {
+            fprintf(stderr, "borrowcat61: release failed\n");
+            exit(1);
+        }
+    }
+
+    if (checksum) {
+        uint32_t crc = io61_checksum(inf);
+        if (io61_checksum(outf) != crc) {
+            fprintf(stderr, "borrowcat61: checksums differ\n");
+            exit(1);
+        }
+        char line[100];
+        int n = snprintf(line, sizeof(line), "borrowcat61: crc32c %08x\n", (unsigned) crc);
+        io61_write(outf, line, n);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
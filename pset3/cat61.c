@@ -1,15 +1,26 @@
 #include "io61.h"
 
-// Usage: ./cat61 [-s SIZE] [FILE]
+// Usage: ./cat61 [-s SIZE] [-k] [-c] [FILE]
 //    Copies the input FILE to standard output one character at a time.
+//    With -k, copies it with a single io61_copy instead. With -c, both
+//    files keep checksums, and a line with the CRC32C of the data is
+//    appended to the output if they agree.
 
 int main(int argc, char** argv) {
     // Parse arguments
     size_t inf_size = (size_t) -1;
-    while (argc >= 3) {
-        if (strcmp(argv[1], "-s") == 0) {
+    int use_copy = 0;
+    int checksum = 0;
+    while (argc >= 2) {
+        if (argc >= 3 && strcmp(argv[1], "-s") == 0) {
             inf_size = (size_t) strtoul(argv[2], 0, 0);
             argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-k") == 0) {
+            use_copy = 1;
+            --argc, ++argv;
+        } else if (strcmp(argv[1], "-c") == 0) {
+            checksum = 1;
+            --argc, ++argv;
         } else
             break;
     }
@@ -18,8 +29,14 @@ int main(int argc, char** argv) {
     io61_profile_begin();
     io61_file* inf = io61_open_check(in_filename, O_RDONLY);
     io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+    if (checksum) {
+        io61_setchecksum(inf, 1);
+        io61_setchecksum(outf, 1);
+    }
 
-    while (inf_size > 0) {
+    if (use_copy)
+        io61_copy(inf, outf, inf_size);
+    else while (inf_size > 0) {
         int ch = io61_readc(inf);
         if (ch == EOF)
             break;
@@ -27,6 +44,17 @@ int main(int argc, char** argv) {
         --inf_size;
     }
 
+    if (checksum) {
+        uint32_t crc = io61_checksum(inf);
+        if (io61_checksum(outf) != crc) {
+            fprintf(stderr, "cat61: checksums differ\n");
+            exit(1);
+        }
+        char buf[100];
+        int n = snprintf(buf, sizeof(buf), "cat61: crc32c %08x\n", (unsigned) crc);
+        io61_write(outf, buf, n);
+    }
+
     io61_close(inf);
     io61_close(outf);
     io61_profile_end();
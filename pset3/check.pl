@@ -679,4 +679,124 @@ run(25,
     "piped large file, 1B-4KB block I/O, sequential");
 
 
+# KERNEL COPY (io61_copy)
+
+run(26,
+    "./cat61 -k files/text20meg.txt > files/out.txt",
+    "regular large file, whole-file copy");
+
+run(27,
+    "./blockcat61 -k files/text20meg.txt > files/out.txt",
+    "regular large file, 4KB block copy");
+
+run(28,
+    "./randblockcat61 -k files/text20meg.txt > files/out.txt",
+    "regular large file, 1B-4KB block copy");
+
+run(29,
+    "./cat61 -k files/text20meg.txt | cat > files/out.txt",
+    "regular large file to pipe, whole-file copy");
+
+run(30,
+    "cat files/text20meg.txt | ./cat61 -k > files/out.txt",
+    "pipe to regular file, whole-file copy");
+
+run(31,
+    "cat files/text20meg.txt | ./blockcat61 -k | cat > files/out.txt",
+    "pipe to pipe, 4KB block copy");
+
+
+# READ/WRITE FILES (in-place update)
+
+run(32,
+    "cp files/text5meg.txt files/out.txt && ./patch61 files/out.txt > files/out2.txt",
+    "regular medium file, 64B records patched in place, sequential");
+
+run(33,
+    "cp files/text5meg.txt files/out.txt && ./patch61 -r 6582 files/out.txt > files/out2.txt",
+    "regular medium file, 64B records patched in place, random order");
+
+run(34,
+    "cp files/text20meg.txt files/out.txt && ./patch61 -b 4096 files/out.txt > files/out2.txt",
+    "regular large file, every 4KB block patched in place");
+
+
+# LINE I/O (io61_readline, io61_scan_until)
+
+run(35,
+    "./linecat61 files/text20meg.txt > files/out.txt",
+    "regular large file, line I/O, sequential");
+
+run(36,
+    "./linecat61 -s files/text20meg.txt > files/out.txt",
+    "regular large file, line I/O skipping every other line");
+
+run(37,
+    "cat files/text20meg.txt | ./linecat61 | cat > files/out.txt",
+    "piped large file, line I/O, sequential");
+
+
+# COMPRESSION FILTER (io61_open_filter)
+
+run(38,
+    "./lzcat61 files/text20meg.txt > files/out.bin",
+    "regular large file, compressed");
+
+run(39,
+    "./lzcat61 files/text20meg.txt | ./lzcat61 -d | cat > files/out.txt",
+    "piped large file, compressed and decompressed");
+
+run(40,
+    "./lzcat61 files/text5meg.txt > files/out1.bin && ./lzcat61 -d -o 1000000 files/out1.bin > files/out.txt",
+    "regular medium file, compressed, then decompressed from a seek");
+
+
+# CHECKSUMS (io61_checksum)
+
+run(41,
+    "./cat61 -c files/text20meg.txt > files/out.txt",
+    "regular large file, character I/O, checksummed");
+
+run(42,
+    "./blockcat61 -c -k files/text20meg.txt > files/out.txt",
+    "regular large file, 4KB block copy, checksummed");
+
+run(43,
+    "cat files/text20meg.txt | ./blockcat61 -c | cat > files/out.txt",
+    "piped large file, 4KB block I/O, checksummed");
+
+
+# SHARED INPUTS (several io61 files on one file)
+
+run(44,
+    "./gather61 -b 4096 files/text5meg.txt files/text5meg.txt files/text5meg.txt > files/out.txt",
+    "regular medium file opened three times, interleaved 4KB blocks");
+
+
+# DIRECT I/O (IO61_DIRECT)
+
+run(45,
+    "IO61_DIRECT=1 ./cat61 files/text20meg.txt > files/out.txt",
+    "regular large file, character I/O, direct");
+
+run(46,
+    "IO61_DIRECT=1 ./blockcat61 -b 1000 files/text20meg.txt > files/out.txt",
+    "regular large file, 1KB block I/O, direct");
+
+
+
+# BORROWED READS (io61_borrow, io61_release)
+
+run(47,
+    "./borrowcat61 files/text20meg.txt > files/out.txt",
+    "regular large file, borrowed 4KB blocks, half released");
+
+run(48,
+    "cat files/text20meg.txt | ./borrowcat61 -b 1000 | cat > files/out.txt",
+    "piped large file, borrowed 1KB blocks, half released");
+
+run(49,
+    "./borrowcat61 -c files/text5meg.txt > files/out.txt",
+    "regular medium file, borrowed 4KB blocks, checksummed");
+
 summary();
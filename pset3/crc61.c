@@ -0,0 +1,136 @@
+#include "crc61.h"
+#include <string.h>
+
+// crc61.c
+//    CRC32C, computed with the SSE4.2 crc32 instruction where the CPU has
+//    it and with slicing-by-8 tables otherwise (or always, with
+//    `make CRC_HW=0`).
+
+#ifndef CRC61_HW
+#define CRC61_HW 1
+#endif
+#if CRC61_HW && (defined(__x86_64__) || defined(__i386__))
+#include <nmmintrin.h>
+#define CRC61_X86 1
+#else
+#define CRC61_X86 0
+#endif
+
+// The CRC32C polynomial, bit-reversed
+#define CRC61_POLY 0x82F63B78U
+
+/* crc_table[0] is the usual byte-at-a-time table. crc_table[k][b] is the
+ * CRC of byte b followed by k zero bytes, so slicing-by-8 can look up the
+ * eight bytes of a word independently and combine them with XOR.
+ * crc_method is 0 until the first call picks 1 (instruction) or 2
+ * (tables).
+ */
+static uint32_t crc_table[8][256];
+static int crc_method;
+
+/* This function fills crc_table.
+ */
+static void crc_init_tables(void) {
+    for (unsigned i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j = 0; j < 8; j++) {
+            c = (c >> 1) ^ (c & 1 ? CRC61_POLY : 0);
+        }
+        crc_table[0][i] = c;
+    }
+    for (unsigned i = 0; i < 256; i++) {
+        for (int k = 1; k < 8; k++) {
+            uint32_t c = crc_table[k - 1][i];
+            crc_table[k][i] = (c >> 8) ^ crc_table[0][c & 255];
+        }
+    }
+}
+
+/* This function returns the 4 little-endian bytes at `p`.
+ */
+static uint32_t crc_get32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* This function updates the (uninverted) CRC `c` with `n` bytes at `p`,
+ * eight bytes per step with the tables.
+ */
+static uint32_t crc_tables(uint32_t c, const unsigned char* p, size_t n) {
+    while (n >= 8) {
+        uint32_t lo = crc_get32(p) ^ c;
+        uint32_t hi = crc_get32(p + 4);
+        c = crc_table[7][lo & 255] ^ crc_table[6][(lo >> 8) & 255]
+            ^ crc_table[5][(lo >> 16) & 255] ^ crc_table[4][lo >> 24]
+            ^ crc_table[3][hi & 255] ^ crc_table[2][(hi >> 8) & 255]
+            ^ crc_table[1][(hi >> 16) & 255] ^ crc_table[0][hi >> 24];
+        p += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        c = (c >> 8) ^ crc_table[0][(c ^ *p++) & 255];
+        n--;
+    }
+    return c;
+}
+
+#if CRC61_X86
+/* This function updates the CRC `c` with `n` bytes at `p` using the
+ * crc32 instruction, a word at a time once `p` is aligned.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc_sse42(uint32_t c, const unsigned char* p, size_t n) {
+    while (n > 0 && ((uintptr_t) p & 7) != 0) {
+        c = _mm_crc32_u8(c, *p++);
+        n--;
+    }
+#if defined(__x86_64__)
+    uint64_t c64 = c;
+    while (n >= 8) {
+        uint64_t x;
+        memcpy(&x, p, 8);
+        c64 = _mm_crc32_u64(c64, x);
+        p += 8;
+        n -= 8;
+    }
+    c = c64;
+#endif
+    while (n >= 4) {
+        uint32_t x;
+        memcpy(&x, p, 4);
+        c = _mm_crc32_u32(c, x);
+        p += 4;
+        n -= 4;
+    }
+    while (n > 0) {
+        c = _mm_crc32_u8(c, *p++);
+        n--;
+    }
+    return c;
+}
+#endif
+
+
+// crc61(crc, data, n)
+//    Return the CRC32C of the data whose CRC32C is `crc` followed by the
+//    `n` bytes at `data`. The CRC32C of no data is 0.
+
+uint32_t crc61(uint32_t crc, const void* data, size_t n) {
+    if (crc_method == 0) {
+#if CRC61_X86
+        __builtin_cpu_init();
+        crc_method = __builtin_cpu_supports("sse4.2") ? 1 : 2;
+#else
+        crc_method = 2;
+#endif
+        if (crc_method == 2) {
+            crc_init_tables();
+        }
+    }
+    const unsigned char* p = (const unsigned char*) data;
+#if CRC61_X86
+    if (crc_method == 1) {
+        return ~crc_sse42(~crc, p, n);
+    }
+#endif
+    return ~crc_tables(~crc, p, n);
+}
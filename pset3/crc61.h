@@ -0,0 +1,12 @@
+#ifndef CRC61_H
+#define CRC61_H
+#include <stddef.h>
+#include <stdint.h>
+
+// crc61.h
+//    CRC32C (the Castagnoli CRC of iSCSI, ext4 and SSE4.2), which every
+//    io61 version uses for io61_checksum.
+
+uint32_t crc61(uint32_t crc, const void* data, size_t n);
+
+#endif
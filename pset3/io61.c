@@ -1,13 +1,94 @@
+#define _GNU_SOURCE
 #include "io61.h"
+#include "lz61.h"
+#include "crc61.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
 #include <errno.h>
 #include <stdbool.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <linux/futex.h>
+#include <pthread.h>
 
+/* Each file picks its own buffer size when it is opened (see
+ * default_buffer_size); BUFFER_SIZE is the fallback when nothing better
+ * is known. Regular files get at least REGULAR_BUFFER_SIZE, nothing gets
+ * more than MAX_BUFFER_SIZE, and terminals get TTY_BUFFER_SIZE.
+ */
 #define BUFFER_SIZE 4096
+#define REGULAR_BUFFER_SIZE (64 << 10)
+#define MAX_BUFFER_SIZE (1 << 20)
+#define TTY_BUFFER_SIZE 1024
+/* Default number of cache slots per file; the IO61_SLOTS environment
+ * variable overrides it.
+ */
 #define NUM_CACHE 12
+/* Once a seek pattern repeats PATTERN_CONFIRM times we trust it. Files
+ * read with pread then ask the kernel to read the next PREFETCH_WINDOW
+ * bytes along dense patterns.
+ */
+#define PATTERN_CONFIRM 2
+#define PREFETCH_WINDOW (256 << 10)
+/* Regular output files that seek are written through a shared mapping.
+ * The file is grown with ftruncate at least this much at a time (and at
+ * least doubled) so growing it stays rare.
+ */
+#define WRITE_EXTENT (1 << 20)
+/* The output mapping covers at least this much address space (and at
+ * least twice the file), so it rarely has to be moved as the file grows.
+ */
+#define WRITE_MAP_MIN (64 << 20)
+/* io61_copy asks the kernel to copy at most this much per system call.
+ */
+#define COPY_CHUNK (1 << 30)
+/* The io_uring backend is off unless io61 is built with `make URING=1`
+ * or run with IO61_URING=1 in the environment, except for direct files
+ * (see IO61_DIRECT); IO61_URING=0 turns it off for everything. The
+ * process shares one ring of URING_ENTRIES requests. Inputs read with
+ * pread keep up to URING_AHEAD blocks (at most half their slots) in
+ * flight ahead of the reader.
+ */
+#ifndef IO61_URING
+#define IO61_URING 0
+#endif
+#define URING_ENTRIES 64
+#define URING_AHEAD 8
+/* With IO61_PREFETCH=1 in the environment, a thread reads non-seekable
+ * inputs ahead of the program into a ring of PREFETCH_DEPTH buffers.
+ */
+#define PREFETCH_DEPTH 4
+/* Inputs of up to MAP_WHOLE_MAX bytes are mapped whole. Larger ones are
+ * mapped in windows of MAP_WINDOW bytes, at most MAP_WINDOWS at a time,
+ * so address space and resident memory stay bounded.
+ */
+#define MAP_WINDOW ((off_t) 64 << 20)
+#define MAP_WINDOWS 4
+#define MAP_WHOLE_MAX (MAP_WINDOWS * MAP_WINDOW)
+/* Slot buffers come from a pool shared by every file, and a slot only
+ * gets one when it first needs it. The buffers attached to slots and the
+ * free ones the pool keeps for reuse stay within POOL_BUDGET bytes
+ * (IO61_POOL_MB in the environment overrides it) by taking buffers back
+ * from slots, of any file, that can spare them. The budget is soft: a
+ * slot that needs a buffer gets one even if none can be taken back.
+ */
+#define POOL_BUDGET ((size_t) 64 << 20)
+/* With IO61_DIRECT=1 in the environment, regular files opened read-only
+ * or write-only move their data with O_DIRECT, so one-shot copies of big
+ * files don't push other processes' data out of the page cache. They use
+ * blocks of DIRECT_BUFFER_SIZE bytes and, as no kernel read-ahead or
+ * write-behind overlaps their I/O, keep several in flight with io_uring
+ * whenever the kernel has it (unless IO61_URING=0). Slot buffers are
+ * always aligned to BUFFER_ALIGN bytes, which must cover the memory
+ * alignment direct I/O needs.
+ */
+#define DIRECT_BUFFER_SIZE (1 << 20)
+#define BUFFER_ALIGN 4096
 
 // io61.c
 //    YOUR CODE HERE!
@@ -16,11 +97,108 @@
 // io61_file
 //    Data structure for io61 file wrappers. Add your own stuff.
 
+/* These are the access patterns the seek predictor recognizes.
+ */
+typedef enum access_pattern {
+    PATTERN_UNKNOWN,
+    PATTERN_SEQUENTIAL,
+    PATTERN_REVERSE,
+    PATTERN_STRIDE,
+    PATTERN_RANDOM
+} access_pattern;
+
+/* These are the ways io61_copy can have the kernel copy data, in the
+ * order they are tried. COPY_BUFFERED means none of them worked.
+ */
+typedef enum copy_method {
+    COPY_RANGE,       // copy_file_range: regular file to regular file
+    COPY_SENDFILE,    // sendfile: regular file to anything
+    COPY_SPLICE,      // splice: into or out of a pipe
+    COPY_BUFFERED
+} copy_method;
+
+/* These are the counters every file keeps, and stat_names their names in
+ * io61_profile_stats's report. System calls are counted by kind: reads
+ * (read, readv, pread), writes (write, writev, pwritev), lseeks, mmaps
+ * (mmap, munmap), kernel copies (copy_file_range, sendfile, splice) and
+ * everything else (fstat, fcntl, ftruncate, fadvise, ...). Requests
+ * handed to io_uring count as uring ops instead, and the io_uring_enter
+ * calls that submit them are counted for the process, not per file.
+ * Cache hits and misses count block lookups in seekable files, evictions
+ * the blocks pushed out to make room, and seeks and flushes the calls to
+ * io61_seek and io61_flush on writable files (not the flushes the
+ * library does itself when a buffer fills). Shared hits are missed
+ * blocks copied from another file open on the same inode instead of read.
+ */
+typedef enum io61_stat {
+    STAT_FILES,
+    STAT_READ_CALLS,
+    STAT_WRITE_CALLS,
+    STAT_LSEEK_CALLS,
+    STAT_MMAP_CALLS,
+    STAT_COPY_CALLS,
+    STAT_OTHER_CALLS,
+    STAT_URING_OPS,
+    STAT_URING_ENTERS,
+    STAT_BYTES_READ,
+    STAT_BYTES_WRITTEN,
+    STAT_BYTES_COPIED,
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_EVICTIONS,
+    STAT_SEEKS,
+    STAT_FLUSHES,
+    STAT_SHARED_HITS,
+    NSTATS
+} io61_stat;
+
+static const char* const stat_names[NSTATS] = {
+    "files", "read_calls", "write_calls", "lseek_calls", "mmap_calls",
+    "copy_calls", "other_calls", "uring_ops", "uring_enters",
+    "bytes_read", "bytes_written", "bytes_copied", "cache_hits",
+    "cache_misses", "evictions", "seeks", "flushes", "shared_hits"
+};
+
+/* This is one mapped window of an input file: `len` bytes from file
+ * offset `start` at `data`, or unused if data is NULL. use is when the
+ * window was last used, for picking the least recently used.
+ */
+typedef struct map_window {
+    char* data;
+    off_t start;
+    size_t len;
+    unsigned long use;
+} map_window;
+
+/* Every regular input file open in io61 has an io61_inode, which all the
+ * io61_files open on the same file (same device, inode and size) share:
+ * refs of them, listed through files and their next_share. They share
+ * its mapping, in windows of map_size bytes aligned to map_size (so a
+ * single window for files mapped whole; map_clock counts window uses),
+ * and missed blocks can be copied from each other's slots. Files too
+ * large to map whole get an inode of their own, since moving a window
+ * for one reader would unmap data another reader's buffer points into.
+ * inodes lists the shared ones.
+ */
+typedef struct io61_inode {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int refs;
+    io61_file* files;
+    off_t map_size;
+    map_window windows[MAP_WINDOWS];
+    unsigned long map_clock;
+    struct io61_inode* next;
+} io61_inode;
+
+static io61_inode* inodes;
+
 /* Here is my cache_slot structure. My io61_file contains an array
  * of these structs along with other information.
  */
 typedef struct cache_slot {
-    unsigned char arr_buf[BUFFER_SIZE];
+    unsigned char* arr_buf;
     unsigned char* str_buf;
     bool is_active;    
     /* This is the current position of the character we are reading
@@ -30,57 +208,504 @@ typedef struct cache_slot {
     /* This is the offset within the file we are seeking, using in 
      * our io61_seek function
      */
-    size_t offset;
-    /* Current size of our buffer. Typical this will be BUFFER_SIZE but
+    off_t offset;
+    /* Current size of our buffer. Typical this will be the file's bufsize but
      * can be smaller when reading from smaller files or when reaching the
-     * end of a file that's size is not a multiple of BUFFER_SIZE
+     * end of a file that's size is not a multiple of bufsize
      */
     size_t buff_size;
-    /* This is the value of the files cache_count field when this cache_slot
-     * was created. This is used to find the oldest cache during the 
-     * get_free_cache function below.
+    /* Read slots of seekable files hold one bufsize-aligned block and
+     * are indexed by block number in the file's hash table; next is the
+     * following slot in the same bucket, or -1. referenced is the CLOCK
+     * bit, set whenever the slot is used and cleared as the clock hand
+     * passes.
      */
-    int created_count;
+    int next;
+    bool referenced;
+    /* True while an io_uring read into, or write from, arr_buf is in
+     * flight; io_result is its result once it completes. writing is true
+     * from when a background write of the slot is queued until
+     * uring_finish_write has checked its result.
+     */
+    bool io_pending;
+    int io_result;
+    bool writing;
+    /* In read/write files, bytes [dirty_start, dirty_end) of the block
+     * have been written but not yet written back.
+     */
+    size_t dirty_start;
+    size_t dirty_end;
 } cache_slot;
 
 struct io61_file {
+    /* The inline io61_readc and io61_writec work on buf, which exposes
+     * the unread part of the current read slot or the free part of the
+     * current write slot (or of the output mapping). Out-of-line
+     * functions first fold it back with fast_sync; io61_readc_slow,
+     * io61_writec_slow and io61_seek expose it again with fast_expose.
+     */
+    io61_buffer buf;
     int fd;
     int mode;
-    char* file_data;
+    /* Regular inputs have an inode (see io61_inode), and next_share is
+     * the next file sharing it. Mapped inputs have mapped set and use its
+     * mapping.
+     */
+    io61_inode* ino;
+    io61_file* next_share;
+    bool mapped;
     size_t file_offset;
-    /* This is our array of cache_slots, the size of which is determined by
-     * the #define statement above.
+    /* This is our array of nslots cache_slots (NUM_CACHE by default).
+     * Their arr_bufs of bufsize (1 << bufshift) bytes each come from
+     * the pool when the slot is first filled (see slot_attach), so
+     * mapped input files, which never copy into arr_buf, and pipes use
+     * none. index is a hash table of index_mask + 1 buckets, each the
+     * first slot holding a block with that hash, or -1. clock_hand is
+     * the next slot the CLOCK eviction looks at.
      */
-    cache_slot cache[NUM_CACHE];
-    int filesize;
+    cache_slot* cache;
+    int nslots;
+    size_t bufsize;
+    int bufshift;
+    int* index;
+    unsigned index_mask;
+    int clock_hand;
+    off_t filesize;
     /* This is the index of the current cache we are working with. Defaults to
      * -1 when the file is opened until our first cache is filled.
      */
     int curr_cache;
-    /* This is the total_cache counter used for determining the age of the caches
-     * we create.
+    /* Read-ahead buffer for non-seekable inputs, bufsize bytes long.
+     * ra_size is how much the next read() asks for; it grows while reads
+     * come back full and shrinks on short reads, so bulk streams get few
+     * large reads while request/response traffic keeps a small buffer.
+     */
+    unsigned char* ra_buf;
+    size_t ra_size;
+    /* bg_ok is true for a non-seekable input that should be read by a
+     * prefetch thread, which is started on the first read and is bg.
+     */
+    bool bg_ok;
+    struct prefetch_ring* bg;
+    /* Access-pattern predictor for seekable inputs. pf_last is the
+     * previous seek target and pf_stride the distance between the last
+     * two; pf_hits counts how many times in a row the pattern repeated.
+     * pf_next is how far prefetch hints have been issued in the direction
+     * of travel, so a dense pattern costs one hint per PREFETCH_WINDOW
+     * rather than one per seek.
+     */
+    access_pattern pf_pattern;
+    off_t pf_last;
+    off_t pf_stride;
+    int pf_hits;
+    off_t pf_next;
+    /* Mapped writer state for regular output files. wmap_ok is true for a
+     * regular output file that hasn't tried the mapped writer yet, and
+     * wmap_fd is -1 unless the mapped writer is in use. wmap_fd is an
+     * O_RDWR descriptor for the same file (mmap needs read access),
+     * wmap_len is how much is mapped and wfile_size the size the file has
+     * been ftruncated to. wpos is the current write offset and wend the
+     * final size the file will be truncated to at close.
+     */
+    bool wmap_ok;
+    /* True once a seekable output that can't use the mapped writer has
+     * seeked. From then on every write cache slot holds dirty data for
+     * the file range starting at its offset, seeks just pick a slot, and
+     * dirty slots are written back in offset order with pwritev.
      */
-    int cache_count;
+    bool wblocks;
+    char* wmap;
+    int wmap_fd;
+    size_t wmap_len;
+    off_t wfile_size;
+    off_t wpos;
+    off_t wend;
+    /* True if this file's pread reads and write()s go through io_uring.
+     */
+    bool uring;
+    /* Files using direct I/O (see IO61_DIRECT) have dio_fd, an O_DIRECT
+     * descriptor for the same file, and dio_align, the alignment direct
+     * I/O needs for file offsets and lengths; dio_fd is -1 otherwise. A
+     * direct writer's slots hold bufsize-aligned blocks of the file, like
+     * read slots, so aligned file offsets are aligned in memory too. The
+     * unwritten data of a block is [dirty_start, pos), and while its
+     * direct write is in flight (writing is set) that covers
+     * [dirty_start, dirty_end).
+     */
+    int dio_fd;
+    size_t dio_align;
+    /* True for seekable files opened O_RDWR. Reads and writes share their
+     * block slots (see rw_block_at), so reads see buffered writes, and
+     * dirty ranges are written back when a slot is reused or the file is
+     * flushed. disk_size is how much of the file is on disk, so bytes
+     * past it (but before filesize) are ones our writes created.
+     */
+    bool rw;
+    off_t disk_size;
+    /* io61_readline copies lines that span slots into line_buf, which has
+     * room for line_cap bytes.
+     */
+    char* line_buf;
+    size_t line_cap;
+    /* Files made by io61_open_filter have no descriptor of their own; lz
+     * is the compressed stream they read from or write to. Their single
+     * slot holds one frame: a reader's str_buf is the frame lz decoded,
+     * and a writer's slot is compressed whenever it fills or is flushed.
+     */
+    struct lz61_stream* lz;
+    /* With checksum set, crc is the CRC32C of the data read from or
+     * written to the file so far, in order. Bytes the inline functions
+     * move through buf are added when fast_sync folds it back: crc_from
+     * is where buf was when it was exposed. lent is where the last
+     * io61_borrow's bytes are, for io61_release to add.
+     */
+    bool checksum;
+    uint32_t crc;
+    const unsigned char* crc_from;
+    const unsigned char* lent;
+    /* This file's counters, and the next file in the list of open files
+     * io61_profile_stats adds up.
+     */
+    unsigned long long stats[NSTATS];
+    io61_file* next_open;
 };
 
-/* This function looks through our array of caches and returns the first
- * inactive cache or the cache that was created earliest.
+/* The counters of files that have been closed (and the process's
+ * io_uring_enter calls), and the list of files that are still open.
  */
-cache_slot* get_free_cache(io61_file *f) {
-    int oldest_cache = 0;
-    int lowest_count = INT_MAX;
-    for (int i = 0; i < NUM_CACHE; i++) {
-        cache_slot* curr_cache = &f->cache[i];
-        if (!curr_cache->is_active) {
-            curr_cache->is_active = true;
-            return curr_cache;
+static unsigned long long closed_stats[NSTATS];
+static io61_file* open_files;
+
+/* The process's pool of slot buffers (see POOL_BUDGET), whose budget is
+ * read from the environment on first use. used bytes of buffers are
+ * attached to slots and cached bytes wait on free[s], the list of free
+ * buffers of 1 << s bytes, linked through their first bytes. hand is the
+ * open file the next reclaim starts at.
+ */
+typedef struct io61_pool {
+    size_t budget;
+    size_t used;
+    size_t cached;
+    void* free[64];
+    io61_file* hand;
+} io61_pool;
+
+static io61_pool pool;
+
+/* The process's io_uring, shared by every file and set up on first use.
+ * fd is -1 before that, -2 if io_uring is off by default (direct files
+ * may still set it up) and -3 if IO61_URING=0 turned it off or it is
+ * unavailable.
+ * The pointers are into the rings the kernel shares with us. nqueued
+ * requests have been queued but not yet submitted and inflight have been
+ * submitted but not reaped; together they never exceed entries, so the
+ * completion ring can't overflow.
+ */
+typedef struct io61_uring {
+    int fd;
+    unsigned entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned nqueued;
+    unsigned inflight;
+} io61_uring;
+
+static io61_uring uring = { .fd = -1 };
+
+/* A prefetch thread and the reader share this ring of PREFETCH_DEPTH
+ * buffers of bufsize bytes. Only the thread writes head (how many buffers
+ * it has filled) and only the reader writes tail (how many it is done
+ * with), so buffer i % PREFETCH_DEPTH belongs to the thread while
+ * head - tail < PREFETCH_DEPTH and to the reader from when head passes i
+ * until tail does. len[i] is how much buffer i holds, 0 at end of file or
+ * -1 on an error, after which the thread exits. Whoever waits for the
+ * other's index sets its waiting flag first, so the other only makes a
+ * futex wake call when someone is asleep. holding is true while the
+ * reader is using buffer tail, and eof once it has seen the end. The
+ * thread counts its reads and bytes in nreads and nbytes.
+ */
+typedef struct prefetch_ring {
+    pthread_t thread;
+    int fd;
+    size_t bufsize;
+    unsigned char* mem;
+    ssize_t len[PREFETCH_DEPTH];
+    unsigned head;
+    unsigned tail;
+    int reader_waiting;
+    int thread_waiting;
+    bool stop;
+    bool holding;
+    bool eof;
+    unsigned long long nreads;
+    unsigned long long nbytes;
+} prefetch_ring;
+
+/* This function returns the bucket in the block index for the block
+ * starting at file offset `offset`.
+ */
+int* index_bucket(io61_file *f, off_t offset) {
+    uint64_t block = offset >> f->bufshift;
+    return &f->index[(block * 0x9E3779B1U) & f->index_mask];
+}
+
+/* This function removes a slot from the block index.
+ */
+void index_remove(io61_file *f, cache_slot* slot) {
+    int* link = index_bucket(f, slot->offset);
+    while (*link != slot - f->cache) {
+        link = &f->cache[*link].next;
+    }
+    *link = slot->next;
+}
+
+/* This function adds a slot to the block index under its offset.
+ */
+void index_insert(io61_file *f, cache_slot* slot) {
+    int* bucket = index_bucket(f, slot->offset);
+    slot->next = *bucket;
+    *bucket = slot - f->cache;
+}
+
+/* This function sets up the process's io_uring the first time a file
+ * could use it, if it is enabled or `direct` is true (the file uses
+ * direct I/O), and returns whether it is available. It needs a kernel
+ * that maps both rings at once and accepts offset -1 for "the file
+ * position" (5.6 or later); with anything less, or if
+ * io_uring_setup fails (old kernels, seccomp filters), io61 just keeps
+ * using plain system calls.
+ */
+bool uring_init(bool direct) {
+    if (uring.fd == -1) {
+        const char* env = getenv("IO61_URING");
+        if (env && !atoi(env)) {
+            uring.fd = -3;
+        } else if (!env && !IO61_URING) {
+            uring.fd = -2;
+        }
+    }
+    if (uring.fd >= 0 || uring.fd == -3 || (uring.fd == -2 && !direct)) {
+        return uring.fd >= 0;
+    }
+    uring.fd = -3;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) {
+        return false;
+    }
+    size_t ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring_len < cq_len) {
+        ring_len = cq_len;
+    }
+    size_t sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    char* ring = MAP_FAILED;
+    void* sqes = MAP_FAILED;
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && (p.features & IORING_FEAT_RW_CUR_POS)) {
+        ring = mmap(NULL, ring_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        sqes = mmap(NULL, sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    }
+    if (ring == MAP_FAILED || sqes == MAP_FAILED) {
+        if (ring != MAP_FAILED) {
+            munmap(ring, ring_len);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_len);
+        }
+        close(fd);
+        return false;
+    }
+    uring.entries = p.sq_entries;
+    uring.sq_head = (unsigned*) (ring + p.sq_off.head);
+    uring.sq_tail = (unsigned*) (ring + p.sq_off.tail);
+    uring.sq_mask = (unsigned*) (ring + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned*) (ring + p.sq_off.array);
+    uring.sqes = (struct io_uring_sqe*) sqes;
+    uring.cq_head = (unsigned*) (ring + p.cq_off.head);
+    uring.cq_tail = (unsigned*) (ring + p.cq_off.tail);
+    uring.cq_mask = (unsigned*) (ring + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe*) (ring + p.cq_off.cqes);
+    uring.fd = fd;
+    return true;
+}
+
+/* This function reaps every completion the kernel has posted, storing
+ * each result in the cache slot the request was for. A request's
+ * user_data is its slot's address, with the low bit set for reads, whose
+ * slots then hold as many bytes as were read.
+ */
+void uring_reap(void) {
+    unsigned head = *uring.cq_head;
+    unsigned tail = __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &uring.cqes[head & *uring.cq_mask];
+        cache_slot* slot = (cache_slot*) (uintptr_t) (cqe->user_data & ~(uint64_t) 1);
+        slot->io_result = cqe->res;
+        slot->io_pending = false;
+        if (cqe->user_data & 1) {
+            slot->buff_size = cqe->res > 0 ? cqe->res : 0;
+        }
+        head++;
+        uring.inflight--;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+/* This function submits every queued request with one io_uring_enter
+ * and, if `wait` is true, also waits for at least one completion. It
+ * only fails if the kernel refuses the ring, which would leave buffers
+ * in the kernel's hands, so that is fatal.
+ */
+void uring_enter(bool wait) {
+    while (true) {
+        int r = syscall(__NR_io_uring_enter, uring.fd, uring.nqueued, wait ? 1 : 0,
+                        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        closed_stats[STAT_URING_ENTERS]++;
+        if (r >= 0) {
+            uring.nqueued -= r;
+            uring.inflight += r;
+            return;
+        } else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fprintf(stderr, "io61: io_uring_enter: %s\n", strerror(errno));
+            abort();
+        }
+        // EAGAIN and EBUSY mean the kernel wants completions reaped first
+        uring_reap();
+    }
+}
+
+/* This function queues a read (IORING_OP_READ) or write (IORING_OP_WRITE,
+ * or IORING_OP_WRITEV with `buf` an iovec array and `len` its length) of
+ * `len` bytes between `f`'s descriptor (its direct one, if it has one)
+ * and `buf` at file offset `off` (-1 for the descriptor's position), on
+ * behalf of `slot`, which is pending until it completes. If the ring is
+ * full, queued requests are submitted and completions waited for until
+ * there is room.
+ */
+void uring_queue(io61_file *f, int op, void* buf, size_t len, off_t off, cache_slot* slot) {
+    while (uring.nqueued + uring.inflight >= uring.entries) {
+        uring_enter(uring.inflight > 0);
+        uring_reap();
+    }
+    unsigned tail = *uring.sq_tail;
+    unsigned i = tail & *uring.sq_mask;
+    struct io_uring_sqe* sqe = &uring.sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = f->dio_fd >= 0 ? f->dio_fd : f->fd;
+    sqe->addr = (uintptr_t) buf;
+    sqe->len = len;
+    sqe->off = off;
+    sqe->user_data = (uintptr_t) slot | (op == IORING_OP_READ);
+    uring.sq_array[i] = i;
+    __atomic_store_n(uring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    uring.nqueued++;
+    slot->io_pending = true;
+    f->stats[STAT_URING_OPS]++;
+    if (op == IORING_OP_READ) {
+        // (reads of regular files come back short only at end of file)
+        f->stats[STAT_BYTES_READ] += f->filesize - off < (off_t) len ? f->filesize - off : (off_t) len;
+    }
+}
+
+/* This function waits until `slot`'s request has completed, submitting
+ * it first if it is still queued.
+ */
+void uring_wait(cache_slot* slot) {
+    uring_reap();
+    while (slot->io_pending) {
+        uring_enter(true);
+        uring_reap();
+    }
+}
+
+/* This function returns whether the block starting at `offset` is in a
+ * cache slot or being read into one.
+ */
+bool block_cached(io61_file *f, off_t offset) {
+    int i = *index_bucket(f, offset);
+    while (i != -1 && f->cache[i].offset != offset) {
+        i = f->cache[i].next;
+    }
+    return i != -1;
+}
+
+/* This function returns a slot of another file sharing `f`'s inode that
+ * holds the block at `offset`, in blocks of `f`'s size, or is having it
+ * read by io_uring, or NULL if none does.
+ */
+cache_slot* shared_block(io61_file *f, off_t offset) {
+    for (io61_file* g = f->ino->files; g; g = g->next_share) {
+        if (g == f || g->bufsize != f->bufsize) {
+            continue;
+        }
+        for (int i = *index_bucket(g, offset); i != -1; i = g->cache[i].next) {
+            cache_slot* s = &g->cache[i];
+            if (s->offset == offset && s->is_active) {
+                return s;
+            }
         }
-        if (curr_cache->created_count < lowest_count) {
-            oldest_cache = i;
-            lowest_count = curr_cache->created_count;
+    }
+    return NULL;
+}
+
+/* This function returns which way a pread input is being read, in
+ * blocks: forward until seeks say otherwise, backward for a confirmed
+ * reverse pattern or a small negative stride, and 0 for random access or
+ * strides that skip whole blocks, where reading ahead would be wasted.
+ */
+int read_direction(io61_file *f) {
+    if (f->pf_pattern == PATTERN_UNKNOWN || f->pf_pattern == PATTERN_SEQUENTIAL) {
+        return 1;
+    } else if (f->pf_hits < PATTERN_CONFIRM || f->pf_pattern == PATTERN_RANDOM) {
+        return 0;
+    } else if (f->pf_pattern == PATTERN_REVERSE) {
+        return -1;
+    } else if (f->pf_stride > 0 && f->pf_stride < (off_t) f->bufsize) {
+        return 1;
+    } else {
+        return 0;
+    }
+}
+
+/* This function returns a slot for a new block: an inactive one if there
+ * is one, otherwise the first the CLOCK hand finds that hasn't been used
+ * since the hand last passed it. Blocks that keep being used get a second
+ * chance, so a random-seek working set stays cached instead of being
+ * pushed out in creation order. `keep`, if not NULL, is never chosen
+ * (read-ahead uses this to spare the block being read). The slot is
+ * removed from the index, and any read into it has finished.
+ */
+cache_slot* get_free_cache(io61_file *f, cache_slot* keep) {
+    while (true) {
+        cache_slot* curr_cache = &f->cache[f->clock_hand];
+        f->clock_hand = (f->clock_hand + 1) % f->nslots;
+        if (curr_cache == keep) {
+            continue;
+        } else if (!curr_cache->is_active) {
+            return curr_cache;
+        } else if (curr_cache->referenced) {
+            curr_cache->referenced = false;
+        } else {
+            index_remove(f, curr_cache);
+            curr_cache->is_active = false;
+            f->stats[STAT_EVICTIONS]++;
+            if (curr_cache->io_pending) {
+                uring_wait(curr_cache);
+            }
+            return curr_cache;
         }
     }
-    return &f->cache[oldest_cache];
 }
 
 /* This function returns our current cache determined by the index in our
@@ -94,132 +719,1975 @@ cache_slot* get_curr_cache(io61_file *f) {
     }
 }  
 
-/* This function is used by io61_readc, io61_read and io61_seek to fill caches from data
- * located at the offset position into the file. It uses pread if the file is seekable and
- * read if the file is not.
+/* This function gives `f`'s slot buffer `buf` back to the pool, which
+ * keeps it for reuse if the budget has room.
  */
-cache_slot* fill_new_cache(io61_file *f, size_t offset) {
-    cache_slot* new_cache = get_free_cache(f);
-    size_t chars_read;
+void pool_put(io61_file *f, unsigned char* buf) {
+    pool.used -= f->bufsize;
+    if (pool.used + pool.cached + f->bufsize <= pool.budget) {
+        *(void**) buf = pool.free[f->bufshift];
+        pool.free[f->bufshift] = buf;
+        pool.cached += f->bufsize;
+    } else {
+        free(buf);
+    }
+}
+
+/* This function returns whether the pool may take back the buffer of
+ * `f`'s slot `s`: it must have one, and must not be current, have I/O in
+ * flight, or hold data that hasn't been written yet.
+ */
+bool slot_reclaimable(io61_file *f, cache_slot* s) {
+    if (!s->arr_buf || s - f->cache == f->curr_cache || s->io_pending || s->writing) {
+        return false;
+    } else if (f->rw) {
+        return s->dirty_end == s->dirty_start;
+    } else if (f->mode == O_WRONLY) {
+        return !s->is_active || s->pos == 0;
+    } else {
+        return true;
+    }
+}
+
+/* This function takes the buffer of `f`'s slot `s` back to the pool.
+ * The block the slot held is forgotten.
+ */
+void slot_detach(io61_file *f, cache_slot* s) {
+    if (s->is_active && f->mode != O_WRONLY && f->filesize != -1) {
+        index_remove(f, s);
+        f->stats[STAT_EVICTIONS]++;
+    }
+    s->is_active = false;
+    pool_put(f, s->arr_buf);
+    s->arr_buf = NULL;
+}
+
+/* This function takes back one slot buffer that an open file can spare.
+ * Files take turns, starting after the one the last reclaim took from,
+ * so the pool evicts across files. Within a file the slots are searched
+ * from its clock hand, and as in get_free_cache a block used since the
+ * last pass gets a second chance. Returns false if no slot can spare its
+ * buffer.
+ */
+bool pool_reclaim(void) {
+    io61_file* start = pool.hand ? pool.hand : open_files;
+    for (int pass = 0; pass < 2 && start; pass++) {
+        io61_file* f = start;
+        do {
+            for (int i = 0; i < f->nslots; i++) {
+                cache_slot* s = &f->cache[(f->clock_hand + i) % f->nslots];
+                if (!slot_reclaimable(f, s)) {
+                    continue;
+                } else if (pass == 0 && s->is_active && s->referenced) {
+                    s->referenced = false;
+                    continue;
+                }
+                slot_detach(f, s);
+                pool.hand = f->next_open;
+                return true;
+            }
+            f = f->next_open ? f->next_open : open_files;
+        } while (f != start);
+    }
+    return false;
+}
+
+/* This function gives `f`'s slot `s` a buffer from the pool if it has
+ * none. To stay within the budget, buffers the pool keeps are freed, then
+ * others are taken back from slots (see pool_reclaim). Running out of
+ * memory is fatal, like a refused io_uring, since a slot has no way to
+ * report it.
+ */
+void slot_attach(io61_file *f, cache_slot* s) {
+    if (s->arr_buf) {
+        return;
+    }
+    if (!pool.budget) {
+        const char* env = getenv("IO61_POOL_MB");
+        pool.budget = env && atoi(env) > 0 ? (size_t) atoi(env) << 20 : POOL_BUDGET;
+    }
+    while (!pool.free[f->bufshift] && pool.used + pool.cached + f->bufsize > pool.budget) {
+        if (pool.cached) {
+            int i = 0;
+            while (!pool.free[i]) {
+                i++;
+            }
+            void* buf = pool.free[i];
+            pool.free[i] = *(void**) buf;
+            pool.cached -= (size_t) 1 << i;
+            free(buf);
+        } else if (!pool_reclaim()) {
+            break;
+        }
+    }
+    void* buf = pool.free[f->bufshift];
+    if (buf) {
+        pool.free[f->bufshift] = *(void**) buf;
+        pool.cached -= f->bufsize;
+    } else if (posix_memalign(&buf, BUFFER_ALIGN, f->bufsize) != 0) {
+        fprintf(stderr, "io61: out of memory\n");
+        abort();
+    }
+    pool.used += f->bufsize;
+    s->arr_buf = (unsigned char*) buf;
+}
+
+/* This function is used by fill_new_cache to check if there is currently a cache that
+ * contains data located at the offset position into the file. If so it becomes the
+ * current cache and is returned. For seekable files this is a lookup of the block
+ * number in the hash index.
+ */
+cache_slot* find_cache_offset(io61_file *f, off_t offset) {
+    int i;
     if (f->filesize == -1) {
-        chars_read = read(f->fd, new_cache->arr_buf, BUFFER_SIZE);
+        i = f->cache[0].is_active ? 0 : -1;
     } else {
-        
-        //chars_read = pread(f->fd, new_cache->buffer, BUFFER_SIZE, (off_t) offset);
-        if (f->filesize - offset < BUFFER_SIZE) {
-            chars_read = f->filesize - offset;
-        } else {
-            chars_read = BUFFER_SIZE;
+        i = *index_bucket(f, offset);
+        off_t block_offset = offset & ~(off_t) (f->bufsize - 1);
+        while (i != -1 && f->cache[i].offset != block_offset) {
+            i = f->cache[i].next;
         }
-        new_cache->str_buf = (unsigned char *) &f->file_data[offset];
-    }    
-    if (chars_read == 0) {
-        // we must be at the EOF
-        new_cache->is_active = false;
+    }
+    if (i != -1) {
+        cache_slot* curr_cache = &f->cache[i];
+        if (curr_cache->io_pending) {
+            uring_wait(curr_cache);
+        }
+        // if our our desired offset in the file is contained within curr_cache's
+        // bounds then data we want is in this cache
+        if (curr_cache->offset <= offset &&
+            offset < curr_cache->offset + (off_t) curr_cache->buff_size) {
+            curr_cache->referenced = true;
+            f->curr_cache = i;
+            return curr_cache;
+        }
+    }
+    return NULL;
+}
+
+/* This function allocates the read-ahead buffer of a non-seekable input.
+ */
+bool alloc_readahead(io61_file *f) {
+    f->ra_size = f->bufsize < BUFFER_SIZE ? f->bufsize : BUFFER_SIZE;
+    f->ra_buf = (unsigned char*) malloc(f->bufsize);
+    return f->ra_buf != NULL;
+}
+
+/* This function reads the next chunk of a non-seekable input into the
+ * read-ahead buffer and adapts the size of the next read: it doubles
+ * (up to the file's bufsize, by default the pipe's capacity) when read()
+ * filled the whole buffer and halves (down to BUFFER_SIZE) when it
+ * returned less than half. Returns the number of bytes read, or 0 at end
+ * of file or on error.
+ */
+size_t fill_readahead(io61_file *f) {
+    size_t min_size = f->bufsize < BUFFER_SIZE ? f->bufsize : BUFFER_SIZE;
+    if (!f->ra_buf && !alloc_readahead(f)) {
+        return 0;
+    }
+    ssize_t r = read(f->fd, f->ra_buf, f->ra_size);
+    f->stats[STAT_READ_CALLS]++;
+    if (r <= 0) {
+        return 0;
+    }
+    f->stats[STAT_BYTES_READ] += r;
+    if ((size_t) r == f->ra_size && f->ra_size < f->bufsize) {
+        f->ra_size = f->ra_size * 2 < f->bufsize ? f->ra_size * 2 : f->bufsize;
+    } else if ((size_t) r < f->ra_size / 2 && f->ra_size > min_size) {
+        f->ra_size /= 2;
+    }
+    return r;
+}
+
+/* This function keeps io_uring reads of the blocks after `cur`, in the
+ * direction the file is being read, in flight: up to URING_AHEAD blocks
+ * or half the file's slots. To batch them it only tops up once the
+ * block half way out is missing, and then submits every missing block
+ * with one io_uring_enter.
+ */
+void uring_read_ahead(io61_file *f, cache_slot* cur) {
+    int ahead = f->nslots / 2 < URING_AHEAD ? f->nslots / 2 : URING_AHEAD;
+    int dir = read_direction(f);
+    if (ahead < 2 || dir == 0) {
+        return;
+    }
+    off_t step = dir * (off_t) f->bufsize;
+    off_t mid = (off_t) cur->offset + step * (ahead / 2);
+    if (mid < 0 || mid >= f->filesize || block_cached(f, mid)) {
+        return;
+    }
+    for (int i = 1; i <= ahead; i++) {
+        off_t off = (off_t) cur->offset + step * i;
+        if (off < 0 || off >= f->filesize) {
+            break;
+        } else if (block_cached(f, off) || (f->ino && shared_block(f, off))) {
+            continue;
+        }
+        cache_slot* slot = get_free_cache(f, cur);
+        slot_attach(f, slot);
+        slot->offset = off;
+        slot->str_buf = slot->arr_buf;
+        slot->buff_size = 0;
+        slot->pos = 0;
+        slot->is_active = true;
+        slot->referenced = true;
+        index_insert(f, slot);
+        uring_queue(f, IORING_OP_READ, slot->arr_buf, f->bufsize, off, slot);
+    }
+    if (uring.nqueued) {
+        uring_enter(false);
+    }
+}
+
+/* This function waits until the ring index `word` is no longer `value`,
+ * sleeping on a futex while `*waiting` is set.
+ */
+void ring_wait(unsigned* word, unsigned value, int* waiting) {
+    __atomic_store_n(waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (__atomic_load_n(word, __ATOMIC_ACQUIRE) == value) {
+        syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+    }
+    __atomic_store_n(waiting, 0, __ATOMIC_RELAXED);
+}
+
+/* This function publishes a new value of the ring index `word` and wakes
+ * the other side if it is waiting for it.
+ */
+void ring_publish(unsigned* word, unsigned value, int* waiting) {
+    __atomic_store_n(word, value, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting, __ATOMIC_RELAXED)) {
+        syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/* This function is the prefetch thread. It fills free buffers of the
+ * ring with read() until end of file, an error, or io61_close stops it.
+ */
+void* prefetch_main(void* arg) {
+    prefetch_ring* bg = (prefetch_ring*) arg;
+    while (true) {
+        unsigned head = bg->head;
+        if (head - __atomic_load_n(&bg->tail, __ATOMIC_ACQUIRE) == PREFETCH_DEPTH) {
+            ring_wait(&bg->tail, head - PREFETCH_DEPTH, &bg->thread_waiting);
+        }
+        if (__atomic_load_n(&bg->stop, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        unsigned i = head % PREFETCH_DEPTH;
+        ssize_t r = read(bg->fd, &bg->mem[i * bg->bufsize], bg->bufsize);
+        __atomic_fetch_add(&bg->nreads, 1, __ATOMIC_RELAXED);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r > 0) {
+            __atomic_fetch_add(&bg->nbytes, r, __ATOMIC_RELAXED);
+        }
+        bg->len[i] = r;
+        ring_publish(&bg->head, head + 1, &bg->reader_waiting);
+        if (r <= 0) {
+            return NULL;
+        }
+    }
+}
+
+/* This function starts the prefetch thread of `f`. Returns false if it
+ * can't, and the file is read directly instead.
+ */
+bool prefetch_start(io61_file *f) {
+    prefetch_ring* bg = (prefetch_ring*) calloc(1, sizeof(prefetch_ring));
+    if (bg) {
+        bg->fd = f->fd;
+        bg->bufsize = f->bufsize;
+        bg->mem = (unsigned char*) malloc(PREFETCH_DEPTH * f->bufsize);
+    }
+    if (!bg || !bg->mem || pthread_create(&bg->thread, NULL, prefetch_main, bg) != 0) {
+        if (bg) {
+            free(bg->mem);
+        }
+        free(bg);
+        return false;
+    }
+    f->bg = bg;
+    return true;
+}
+
+/* This function is fill_new_cache's read for files with a prefetch
+ * thread: it hands the buffer the reader was using back to the thread
+ * and makes cache slot 0 use the next filled one, waiting for it if
+ * necessary. Returns the number of bytes it holds, or 0 at end of file
+ * or on error.
+ */
+size_t prefetch_next(io61_file *f) {
+    prefetch_ring* bg = f->bg;
+    if (bg->holding) {
+        bg->holding = false;
+        ring_publish(&bg->tail, bg->tail + 1, &bg->thread_waiting);
+    }
+    if (bg->eof) {
+        return 0;
+    }
+    if (__atomic_load_n(&bg->head, __ATOMIC_ACQUIRE) == bg->tail) {
+        ring_wait(&bg->head, bg->tail, &bg->reader_waiting);
+    }
+    unsigned i = bg->tail % PREFETCH_DEPTH;
+    if (bg->len[i] <= 0) {
+        bg->eof = true;
+        return 0;
+    }
+    bg->holding = true;
+    f->cache[0].str_buf = &bg->mem[i * bg->bufsize];
+    return bg->len[i];
+}
+
+/* This function stops and frees `f`'s prefetch thread. The thread may be
+ * waiting for a free buffer, which stop and a wake-up end, or blocked in
+ * read(), a cancellation point.
+ */
+void prefetch_stop(io61_file *f) {
+    prefetch_ring* bg = f->bg;
+    __atomic_store_n(&bg->stop, true, __ATOMIC_RELEASE);
+    ring_publish(&bg->tail, bg->tail + PREFETCH_DEPTH, &bg->thread_waiting);
+    pthread_cancel(bg->thread);
+    pthread_join(bg->thread, NULL);
+    f->stats[STAT_READ_CALLS] += bg->nreads;
+    f->stats[STAT_BYTES_READ] += bg->nbytes;
+    free(bg->mem);
+    free(bg);
+    f->bg = NULL;
+}
+
+/* This function unmaps window `w` of a mapped input. The cache slots
+ * pointing into it are forgotten first. If one is current it keeps its
+ * position but has nothing left to read, so the next read maps its way
+ * back.
+ */
+void map_release(io61_file *f, map_window* w) {
+    for (int i = 0; i < f->nslots; i++) {
+        cache_slot* s = &f->cache[i];
+        if (s->is_active && s->offset >= w->start && s->offset < w->start + (off_t) w->len) {
+            index_remove(f, s);
+            s->is_active = false;
+            s->buff_size = s->pos;
+        }
+    }
+    munmap(w->data, w->len);
+    f->stats[STAT_MMAP_CALLS]++;
+    w->data = NULL;
+}
+
+/* This function returns a pointer to byte `off` of a mapped input, and
+ * sets `*end` to where the window holding it ends. A window that isn't
+ * mapped yet replaces the least recently used one. Windows a sequential
+ * (or reverse) reader has passed are unmapped as it moves on, so a
+ * streaming read keeps just one. Returns NULL if the window can't be
+ * mapped.
+ */
+char* map_at(io61_file *f, off_t off, off_t* end) {
+    io61_inode* ino = f->ino;
+    off_t start = off - off % ino->map_size;
+    map_window* victim = &ino->windows[0];
+    for (int i = 0; i < MAP_WINDOWS; i++) {
+        map_window* w = &ino->windows[i];
+        if (w->data && w->start == start) {
+            w->use = ++ino->map_clock;
+            *end = start + w->len;
+            return w->data + (off - start);
+        } else if (!w->data || (victim->data && w->use < victim->use)) {
+            victim = w;
+        }
+    }
+    int dir = read_direction(f);
+    for (int i = 0; i < MAP_WINDOWS; i++) {
+        map_window* w = &ino->windows[i];
+        if (w->data && ((dir > 0 && w->start < start) || (dir < 0 && w->start > start))) {
+            map_release(f, w);
+        }
+    }
+    if (victim->data) {
+        map_release(f, victim);
+    }
+    size_t len = f->filesize - start < ino->map_size ? f->filesize - start : ino->map_size;
+    char* data = (char*) mmap(NULL, len, PROT_READ, MAP_SHARED, f->fd, start);
+    f->stats[STAT_MMAP_CALLS]++;
+    if (data == MAP_FAILED) {
         return NULL;
     }
-       
-    new_cache->buff_size = chars_read;
-    new_cache->pos = 0;
-    new_cache->offset = offset;
-    new_cache->is_active = true;
-    f->cache_count++;
-    new_cache->created_count = f->cache_count;
-    f->curr_cache = new_cache - f->cache;
-    return new_cache;
+    victim->data = data;
+    victim->start = start;
+    victim->len = len;
+    victim->use = ++ino->map_clock;
+    *end = start + len;
+    return data + (off - start);
+}
+
+/* This function gives regular input `f` its io61_inode: the one files
+ * already open on the same file share, if there is one, or a new one.
+ * Returns false if the file can't be identified or memory runs out.
+ */
+bool inode_get(io61_file *f) {
+    struct stat s;
+    f->stats[STAT_OTHER_CALLS]++;
+    if (fstat(f->fd, &s) < 0) {
+        return false;
+    }
+    bool whole = f->filesize <= MAP_WHOLE_MAX;
+    io61_inode* ino = whole ? inodes : NULL;
+    while (ino && (ino->dev != s.st_dev || ino->ino != s.st_ino || ino->size != f->filesize)) {
+        ino = ino->next;
+    }
+    if (!ino) {
+        ino = (io61_inode*) calloc(1, sizeof(io61_inode));
+        if (!ino) {
+            return false;
+        }
+        ino->dev = s.st_dev;
+        ino->ino = s.st_ino;
+        ino->size = f->filesize;
+        ino->map_size = whole ? f->filesize : MAP_WINDOW;
+        if (whole) {
+            ino->next = inodes;
+            inodes = ino;
+        }
+    }
+    ino->refs++;
+    f->next_share = ino->files;
+    ino->files = f;
+    f->ino = ino;
+    return true;
+}
+
+/* This function lets go of `f`'s inode, which is unmapped and freed once
+ * no file shares it.
+ */
+void inode_put(io61_file *f) {
+    io61_inode* ino = f->ino;
+    io61_file** link = &ino->files;
+    while (*link != f) {
+        link = &(*link)->next_share;
+    }
+    *link = f->next_share;
+    f->ino = NULL;
+    if (--ino->refs > 0) {
+        return;
+    }
+    for (int i = 0; i < MAP_WINDOWS; i++) {
+        if (ino->windows[i].data) {
+            munmap(ino->windows[i].data, ino->windows[i].len);
+            f->stats[STAT_MMAP_CALLS]++;
+        }
+    }
+    io61_inode** ilink = &inodes;
+    while (*ilink && *ilink != ino) {
+        ilink = &(*ilink)->next;
+    }
+    if (*ilink) {
+        *ilink = ino->next;
+    }
+    free(ino);
+}
+
+/* This function writes all of `iov` to `f` with writev, or with pwritev
+ * at `off` if `off` is not negative, retrying short writes from where they
+ * stopped. `iov` is modified. Returns the number of bytes written, which
+ * is less than asked for only if an error stopped it, or -1 if nothing
+ * could be written.
+ */
+ssize_t write_iov(io61_file *f, struct iovec* iov, int n, off_t off) {
+    ssize_t total = 0;
+    while (n > 0) {
+        ssize_t w = off < 0 ? writev(f->fd, iov, n) : pwritev(f->fd, iov, n, off + total);
+        f->stats[STAT_WRITE_CALLS]++;
+        if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w <= 0) {
+            return total ? total : -1;
+        }
+        total += w;
+        f->stats[STAT_BYTES_WRITTEN] += w;
+        while (n > 0 && (size_t) w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return total;
+}
+
+/* This function notes that read/write file `f` now has data on disk up
+ * to `end`.
+ */
+void rw_written(io61_file *f, off_t end) {
+    if (end > f->disk_size) {
+        f->disk_size = end;
+    }
+}
+
+/* This function writes the dirty range of read/write slot `slot` back
+ * to the file, which leaves the slot clean. Returns 0 on success and -1
+ * on error, when the slot stays dirty.
+ */
+int rw_write_back_slot(io61_file *f, cache_slot* slot) {
+    size_t len = slot->dirty_end - slot->dirty_start;
+    off_t start = slot->offset + (off_t) slot->dirty_start;
+    struct iovec iov[1] = { { &slot->arr_buf[slot->dirty_start], len } };
+    if (write_iov(f, iov, 1, start) != (ssize_t) len) {
+        return -1;
+    }
+    rw_written(f, start + (off_t) len);
+    slot->dirty_start = slot->dirty_end = 0;
+    return 0;
+}
+
+/* This function writes every dirty range of a read/write file back. They
+ * are sorted by offset, and ranges that continue one another (a block
+ * dirty to its end followed by the next block dirty from its start) go
+ * out as one pwritev.
+ */
+int rw_write_back(io61_file *f) {
+    cache_slot* dirty[f->nslots];
+    int ndirty = 0;
+    for (int i = 0; i < f->nslots; i++) {
+        cache_slot* s = &f->cache[i];
+        if (s->is_active && s->dirty_end > s->dirty_start) {
+            // insertion sort by offset
+            int j = ndirty++;
+            while (j > 0 && dirty[j - 1]->offset > s->offset) {
+                dirty[j] = dirty[j - 1];
+                j--;
+            }
+            dirty[j] = s;
+        }
+    }
+    struct iovec iov[ndirty];
+    int r = 0;
+    int i = 0;
+    while (i < ndirty) {
+        off_t start = dirty[i]->offset + (off_t) dirty[i]->dirty_start;
+        size_t len = 0;
+        int n = 0;
+        do {
+            cache_slot* s = dirty[i++];
+            iov[n].iov_base = &s->arr_buf[s->dirty_start];
+            iov[n].iov_len = s->dirty_end - s->dirty_start;
+            len += iov[n++].iov_len;
+            s->dirty_start = s->dirty_end = 0;
+        } while (i < ndirty && dirty[i]->offset + (off_t) dirty[i]->dirty_start == start + (off_t) len);
+        if (write_iov(f, iov, n, start) != (ssize_t) len) {
+            r = -1;
+        } else {
+            rw_written(f, start + (off_t) len);
+        }
+    }
+    return r;
+}
+
+/* This function makes the slot holding the block of read/write file `f`
+ * that contains offset `off` current, with its pos at `off`. A block that
+ * isn't cached is read into a free slot, whose dirty range (if any) is
+ * written back first. Blocks hold the file's bytes up to its current size
+ * (which our own writes may have grown): bytes past disk_size are a hole,
+ * so they are zeros. pos can be past buff_size after a seek beyond the
+ * end of the file. Returns NULL if the write-back fails (the slot keeps
+ * its data) or the block can't be read in full.
+ */
+cache_slot* rw_block_at(io61_file *f, off_t off) {
+    off_t block = off & ~(off_t) (f->bufsize - 1);
+    int i = *index_bucket(f, block);
+    while (i != -1 && f->cache[i].offset != block) {
+        i = f->cache[i].next;
+    }
+    cache_slot* slot;
+    if (i != -1) {
+        slot = &f->cache[i];
+        f->stats[STAT_CACHE_HITS]++;
+    } else {
+        slot = get_free_cache(f, NULL);
+        f->stats[STAT_CACHE_MISSES]++;
+        if (slot->dirty_end > slot->dirty_start && rw_write_back_slot(f, slot) < 0) {
+            slot->is_active = true;
+            index_insert(f, slot);
+            return NULL;
+        }
+        slot_attach(f, slot);
+        ssize_t r = 0;
+        if (block < f->filesize) {
+            r = pread(f->fd, slot->arr_buf, f->bufsize, block);
+            f->stats[STAT_READ_CALLS]++;
+            f->stats[STAT_BYTES_READ] += r > 0 ? r : 0;
+        }
+        slot->offset = block;
+        slot->str_buf = slot->arr_buf;
+        slot->buff_size = r > 0 ? r : 0;
+        off_t on_disk = f->disk_size - block;
+        if (r < 0 || (off_t) r < (on_disk < (off_t) f->bufsize ? on_disk : (off_t) f->bufsize)) {
+            /* A slot that was current stays so, empty and at `off`, as
+             * its old contents are gone
+             */
+            slot->buff_size = 0;
+            slot->pos = off - block;
+            return NULL;
+        }
+        slot->is_active = true;
+        index_insert(f, slot);
+    }
+    size_t valid = 0;
+    if (f->filesize > block) {
+        valid = f->filesize - block < (off_t) f->bufsize ? (size_t) (f->filesize - block) : f->bufsize;
+    }
+    if (valid > slot->buff_size) {
+        memset(&slot->arr_buf[slot->buff_size], 0, valid - slot->buff_size);
+        slot->buff_size = valid;
+    }
+    slot->pos = off - block;
+    slot->referenced = true;
+    f->curr_cache = slot - f->cache;
+    return slot;
+}
+
+/* This function writes `sz` bytes at the current position of read/write
+ * file `f` into its block slots, marking them dirty. Writes to files that
+ * can't seek (sockets, terminals) aren't buffered, since their reads and
+ * writes are separate streams and a peer may be waiting for the data.
+ */
+ssize_t rw_write(io61_file *f, const char* buf, size_t sz) {
+    if (!f->rw) {
+        struct iovec iov[1] = { { (char*) buf, sz } };
+        return write_iov(f, iov, 1, -1);
+    }
+    size_t nwritten = 0;
+    cache_slot* slot = get_curr_cache(f);
+    while (nwritten < sz) {
+        if (!slot || !slot->is_active || slot->pos == f->bufsize) {
+            slot = rw_block_at(f, slot ? slot->offset + (off_t) slot->pos : 0);
+            if (!slot) {
+                return nwritten ? (ssize_t) nwritten : -1;
+            }
+        }
+        size_t n = f->bufsize - slot->pos;
+        if (n > sz - nwritten) {
+            n = sz - nwritten;
+        }
+        if (slot->pos > slot->buff_size) {
+            // skipped bytes past the end of the file are a hole
+            memset(&slot->arr_buf[slot->buff_size], 0, slot->pos - slot->buff_size);
+        }
+        memcpy(&slot->arr_buf[slot->pos], &buf[nwritten], n);
+        if (slot->dirty_end == slot->dirty_start) {
+            slot->dirty_start = slot->pos;
+            slot->dirty_end = slot->pos + n;
+        } else {
+            // one range covers both; anything between is the file's own data
+            slot->dirty_start = slot->pos < slot->dirty_start ? slot->pos : slot->dirty_start;
+            slot->dirty_end = slot->pos + n > slot->dirty_end ? slot->pos + n : slot->dirty_end;
+        }
+        slot->pos += n;
+        nwritten += n;
+        if (slot->pos > slot->buff_size) {
+            slot->buff_size = slot->pos;
+        }
+        if (slot->offset + (off_t) slot->buff_size > f->filesize) {
+            f->filesize = slot->offset + slot->buff_size;
+        }
+    }
+    return nwritten;
+}
+
+/* This function adds the `n` bytes at `p`, which `f`'s caller just read
+ * or wrote, to its checksum, if it keeps one.
+ */
+void crc_add(io61_file *f, const void* p, size_t n) {
+    if (f->checksum) {
+        f->crc = crc61(f->crc, p, n);
+    }
+}
+
+/* This function adds the bytes the inline functions have moved through
+ * `f->buf` since it was exposed (or since the last crc_fold) to `f`'s
+ * checksum.
+ */
+void crc_fold(io61_file *f) {
+    const unsigned char* p = f->buf.rpos ? f->buf.rpos : f->buf.wpos;
+    if (p) {
+        crc_add(f, f->crc_from, p - f->crc_from);
+        f->crc_from = p;
+    }
+}
+
+/* This function folds the positions the inline io61_readc and
+ * io61_writec have advanced in `f->buf` back into the current slot (or
+ * the mapped writer) and hides the buffer from them, so the rest of io61
+ * can move things around.
+ */
+void fast_sync(io61_file *f) {
+    crc_fold(f);
+    if (!f->buf.rpos && !f->buf.wpos) {
+        return;
+    } else if (f->buf.rpos) {
+        cache_slot* curr_cache = get_curr_cache(f);
+        curr_cache->pos = f->buf.rpos - curr_cache->str_buf;
+    } else if (f->buf.wpos && f->wmap_fd >= 0) {
+        f->wpos = f->buf.wpos - (unsigned char*) f->wmap;
+        if (f->wpos > f->wend) {
+            f->wend = f->wpos;
+        }
+    } else if (f->buf.wpos) {
+        cache_slot* curr_cache = get_curr_cache(f);
+        curr_cache->pos = f->buf.wpos - curr_cache->arr_buf;
+    }
+    memset(&f->buf, 0, sizeof(f->buf));
+}
+
+/* This function exposes the current buffer of `f` to the inline
+ * io61_readc and io61_writec: the unread rest of the current slot of a
+ * readable file, or the free rest of the current write slot or the
+ * output mapping. Read/write files only get the read side, since their
+ * writes must mark slots dirty.
+ */
+void fast_expose(io61_file *f) {
+    cache_slot* curr_cache = get_curr_cache(f);
+    if (f->mode != O_WRONLY) {
+        if (curr_cache && curr_cache->pos < curr_cache->buff_size) {
+            f->buf.rpos = &curr_cache->str_buf[curr_cache->pos];
+            f->buf.rend = &curr_cache->str_buf[curr_cache->buff_size];
+        }
+    } else if (f->wmap_fd >= 0) {
+        off_t end = (size_t) f->wfile_size < f->wmap_len ? f->wfile_size : (off_t) f->wmap_len;
+        if (f->wpos < end) {
+            f->buf.wpos = (unsigned char*) &f->wmap[f->wpos];
+            f->buf.wend = (unsigned char*) &f->wmap[end];
+        }
+    } else if (curr_cache && curr_cache->pos < curr_cache->buff_size) {
+        f->buf.wpos = &curr_cache->arr_buf[curr_cache->pos];
+        f->buf.wend = &curr_cache->arr_buf[curr_cache->buff_size];
+    }
+    f->crc_from = f->buf.rpos ? f->buf.rpos : f->buf.wpos;
+}
+
+/* This function makes the frame of filtered input `f` holding byte
+ * `offset` current in slot 0, with its pos at that byte. When `seek` is
+ * false the current frame is used up and the next one is read; otherwise
+ * lz61_seek finds the frame. Returns 0 on success and -1 at end of file
+ * (when not seeking), past it, or on error.
+ */
+int lz_fill(io61_file *f, off_t offset, bool seek) {
+    lz61_stream* lz = f->lz;
+    if (seek ? lz61_seek(lz, offset) < 0 : lz61_next(lz) <= 0) {
+        return -1;
+    }
+    cache_slot* slot = &f->cache[0];
+    slot->str_buf = lz->frame;
+    slot->offset = lz->start;
+    slot->buff_size = lz->len;
+    slot->pos = offset - lz->start;
+    slot->is_active = true;
+    f->curr_cache = 0;
+    return 0;
+}
+
+/* This function compresses what filtered output `f` has buffered into a
+ * frame. Returns 0 on success and -1 on error.
+ */
+int lz_emit(io61_file *f) {
+    cache_slot* slot = &f->cache[0];
+    int r = lz61_put(f->lz, slot->arr_buf, slot->pos);
+    slot->pos = 0;
+    return r;
+}
+
+/* This function sets up direct I/O for `f` (see IO61_DIRECT) if it is
+ * enabled and `f` is a regular file opened read-only or write-only, not
+ * for appending, on a filesystem that supports it. The file is reopened
+ * with O_DIRECT: setting the flag on `f->fd` would change it for whoever
+ * shares the descriptor (like a shell), and we keep `f->fd` for the
+ * unaligned pieces of writes. The alignment is the larger of the memory
+ * and file offset alignments statx reports; kernels before 6.1 don't
+ * report them, and then BUFFER_ALIGN is assumed. Returns whether `f`
+ * uses direct I/O.
+ */
+bool dio_open(io61_file *f) {
+    const char* env = getenv("IO61_DIRECT");
+    if (!env || !atoi(env) || f->filesize == -1 || f->mode == O_RDWR) {
+        return false;
+    }
+    int flags = fcntl(f->fd, F_GETFL);
+    f->stats[STAT_OTHER_CALLS] += 3;    // with the statx and the open
+    if (flags == -1 || (flags & O_APPEND)) {
+        return false;
+    }
+    size_t align = BUFFER_ALIGN;
+#ifdef STATX_DIOALIGN
+    struct statx sx;
+    if (statx(f->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx) == 0
+        && (sx.stx_mask & STATX_DIOALIGN)) {
+        if (sx.stx_dio_offset_align == 0 || sx.stx_dio_mem_align > BUFFER_ALIGN
+            || sx.stx_dio_offset_align > DIRECT_BUFFER_SIZE) {
+            return false;
+        }
+        align = sx.stx_dio_offset_align > sx.stx_dio_mem_align
+            ? sx.stx_dio_offset_align : sx.stx_dio_mem_align;
+    }
+#endif
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", f->fd);
+    f->dio_fd = open(path, f->mode | O_DIRECT);
+    f->dio_align = align;
+    return f->dio_fd >= 0;
+}
+
+/* This function reads the block of `f` at `offset` into `buf` with
+ * pread, through the direct descriptor if `f` has one. Should the kernel
+ * refuse a direct read (an alignment statx didn't tell us about), the
+ * block is read through `f->fd` instead. Returns what pread returned.
+ */
+ssize_t read_block(io61_file *f, unsigned char* buf, off_t offset) {
+    ssize_t r = -1;
+    if (f->dio_fd >= 0) {
+        r = pread(f->dio_fd, buf, f->bufsize, offset);
+        f->stats[STAT_READ_CALLS]++;
+    }
+    if (r < 0) {
+        r = pread(f->fd, buf, f->bufsize, offset);
+        f->stats[STAT_READ_CALLS]++;
+    }
+    f->stats[STAT_BYTES_READ] += r > 0 ? r : 0;
+    return r;
+}
+
+/* This function makes direct writer `f`'s slot `slot` hold the block
+ * containing file offset `pos`, with nothing to write yet and writing
+ * continuing at `pos`.
+ */
+void dio_place(io61_file *f, cache_slot* slot, off_t pos) {
+    slot->offset = pos & ~(off_t) (f->bufsize - 1);
+    slot->pos = pos - slot->offset;
+    slot->dirty_start = slot->pos;
+}
+
+/* This function writes bytes [from, to) of direct writer `f`'s slot
+ * `slot` to their place in the file with pwrite, through the direct
+ * descriptor if `direct` is true. Returns how many bytes were written
+ * before an error stopped it.
+ */
+size_t dio_pwrite(io61_file *f, cache_slot* slot, size_t from, size_t to, bool direct) {
+    size_t done = 0;
+    while (from + done < to) {
+        ssize_t w = pwrite(direct ? f->dio_fd : f->fd, &slot->arr_buf[from + done],
+                           to - from - done, slot->offset + from + done);
+        f->stats[STAT_WRITE_CALLS]++;
+        if (w < 0 && errno == EINTR) {
+            continue;
+        } else if (w <= 0) {
+            break;
+        }
+        done += w;
+        f->stats[STAT_BYTES_WRITTEN] += w;
+    }
+    return done;
+}
+
+/* This function waits for the direct write of slot `slot` that dio_write
+ * left in flight, if any, and writes whatever the kernel didn't (after a
+ * short write, or if it refused an alignment) through `f->fd`. Returns 0
+ * on success and -1 if that write failed too.
+ */
+int dio_finish(io61_file *f, cache_slot* slot) {
+    if (!slot->writing) {
+        return 0;
+    }
+    slot->writing = false;
+    uring_wait(slot);
+    size_t done = slot->io_result > 0 ? slot->io_result : 0;
+    f->stats[STAT_BYTES_WRITTEN] += done;
+    size_t from = slot->dirty_start + done;
+    slot->dirty_start = slot->pos;
+    return dio_pwrite(f, slot, from, slot->dirty_end, false)
+        == slot->dirty_end - from ? 0 : -1;
+}
+
+/* This function writes the unwritten data of direct writer `f`'s slot
+ * `slot`. The part between its first and last dio_align boundaries goes
+ * through the direct descriptor: with io_uring it is queued and left in
+ * flight for dio_finish, otherwise written with pwrite. The unaligned
+ * pieces before and after it, which only the first block written and
+ * flushes leave, are written through `f->fd`. Returns 0 on success and
+ * -1 on error.
+ */
+int dio_write(io61_file *f, cache_slot* slot) {
+    size_t mask = f->dio_align - 1;
+    size_t start = slot->dirty_start, end = slot->pos;
+    size_t a = (start + mask) & ~mask, b = end & ~mask;
+    if (b <= a) {
+        a = b = end;
+    }
+    int r = 0;
+    if (dio_pwrite(f, slot, start, a, false) != a - start) {
+        r = -1;
+    }
+    if (a < b && f->uring) {
+        slot->dirty_start = a;
+        slot->dirty_end = b;
+        uring_queue(f, IORING_OP_WRITE, &slot->arr_buf[a], b - a, slot->offset + a, slot);
+        slot->writing = true;
+        uring_enter(false);
+    } else if (a < b) {
+        size_t done = dio_pwrite(f, slot, a, b, true);
+        if (dio_pwrite(f, slot, a + done, b, false) != b - a - done) {
+            r = -1;
+        }
+    }
+    if (dio_pwrite(f, slot, b, end, false) != end - b) {
+        r = -1;
+    }
+    if (!slot->writing) {
+        slot->dirty_start = end;
+    }
+    return r;
+}
+
+/* This function is used by io61_readc, io61_read and io61_seek to make the cache holding
+ * the data at the offset position into the file current, with its pos at that offset.
+ * Seekable files use the block containing offset, either already cached or filled into
+ * a free slot, straight from their mapping when they have one. Pipes can't go back to
+ * earlier data, so they use a single cache whose buffer is the read-ahead buffer.
+ * Read/write files use the blocks they share with writes.
+ */
+cache_slot* fill_new_cache(io61_file *f, off_t offset) {
+    cache_slot* new_cache;
+    size_t chars_read;
+    int prev_cache = f->curr_cache;
+    if (f->lz) {
+        new_cache = &f->cache[0];
+        if (lz_fill(f, offset, false) < 0 || new_cache->pos >= new_cache->buff_size) {
+            return NULL;
+        }
+        return new_cache;
+    } else if (f->filesize == -1) {
+        new_cache = &f->cache[0];
+        if (f->bg_ok && !f->bg && !prefetch_start(f)) {
+            f->bg_ok = false;
+        }
+        if (f->bg) {
+            chars_read = prefetch_next(f);
+        } else {
+            chars_read = fill_readahead(f);
+            new_cache->str_buf = f->ra_buf;
+        }
+        new_cache->offset = offset;
+    } else if (f->rw) {
+        return offset < f->filesize ? rw_block_at(f, offset) : NULL;
+    } else if ((new_cache = find_cache_offset(f, offset))) {
+        f->stats[STAT_CACHE_HITS]++;
+        new_cache->pos = offset - new_cache->offset;
+        if (f->uring && f->curr_cache != prev_cache) {
+            uring_read_ahead(f, new_cache);
+        }
+        return new_cache;
+    } else if (offset >= f->filesize) {
+        // we must be at the EOF
+        return NULL;
+    } else if (!f->mapped) {
+        // Regular files we couldn't (or, with direct I/O, mustn't) map are
+        // read with pread
+        f->stats[STAT_CACHE_MISSES]++;
+        new_cache = get_free_cache(f, NULL);
+        slot_attach(f, new_cache);
+        new_cache->offset = offset & ~(off_t) (f->bufsize - 1);
+        ssize_t r;
+        cache_slot* shared = f->ino ? shared_block(f, new_cache->offset) : NULL;
+        if (shared) {
+            // Another file open on the same inode has the block already,
+            // or will once its read completes
+            if (shared->io_pending) {
+                uring_wait(shared);
+            }
+            memcpy(new_cache->arr_buf, shared->str_buf, shared->buff_size);
+            r = shared->buff_size;
+            f->stats[STAT_SHARED_HITS]++;
+        } else if (f->uring && read_direction(f) != 0) {
+            // The block goes to the kernel with any read-ahead in one
+            // io_uring_enter (it is marked active so read-ahead spares it).
+            // Random reads have nothing to batch, and pread is cheaper.
+            new_cache->is_active = true;
+            uring_queue(f, IORING_OP_READ, new_cache->arr_buf, f->bufsize,
+                        new_cache->offset, new_cache);
+            uring_read_ahead(f, new_cache);
+            uring_wait(new_cache);
+            r = new_cache->io_result;
+            if (r < 0 && f->dio_fd >= 0) {
+                r = read_block(f, new_cache->arr_buf, new_cache->offset);
+            }
+        } else {
+            r = read_block(f, new_cache->arr_buf, new_cache->offset);
+        }
+        chars_read = r > 0 ? r : 0;
+        new_cache->str_buf = new_cache->arr_buf;
+    } else {
+        f->stats[STAT_CACHE_MISSES]++;
+        new_cache = get_free_cache(f, NULL);
+        new_cache->offset = offset & ~(off_t) (f->bufsize - 1);
+        off_t end;
+        char* data = map_at(f, new_cache->offset, &end);
+        if (!data) {
+            return NULL;
+        }
+        if (end - new_cache->offset < (off_t) f->bufsize) {
+            chars_read = end - new_cache->offset;
+        } else {
+            chars_read = f->bufsize;
+        }
+        new_cache->str_buf = (unsigned char *) data;
+    }
+    if ((off_t) chars_read <= offset - new_cache->offset) {
+        // we must be at the EOF
+        new_cache->is_active = false;
+        return NULL;
+    }
+       
+    new_cache->buff_size = chars_read;
+    new_cache->pos = offset - new_cache->offset;
+    new_cache->is_active = true;
+    new_cache->referenced = true;
+    f->curr_cache = new_cache - f->cache;
+    if (f->filesize != -1) {
+        index_insert(f, new_cache);
+    }
+    return new_cache;
+}
+
+/* This function asks the kernel to start reading bytes [start, end) of a
+ * seekable input read with pread. The range is clipped to the file.
+ */
+void prefetch_range(io61_file *f, off_t start, off_t end) {
+    if (start < 0) {
+        start = 0;
+    }
+    if (end > f->filesize) {
+        end = f->filesize;
+    }
+    if (start < end) {
+        posix_fadvise(f->fd, start, end - start, POSIX_FADV_WILLNEED);
+        f->stats[STAT_OTHER_CALLS]++;
+    }
+}
+
+/* This function is called by io61_seek on readable seekable files. It
+ * classifies the seek that just happened against the previous ones:
+ * landing exactly where the last read stopped is sequential, repeating
+ * the previous distance between seek targets is a stride (reverse when
+ * it is small and negative), and anything else counts towards random.
+ * Once a pattern is confirmed it prefetches along it. `cur` is where
+ * reading would have continued without the seek, or -1 if unknown.
+ */
+void predict_access(io61_file *f, off_t pos, off_t cur) {
+    off_t stride = pos - f->pf_last;
+    access_pattern pattern;
+    if (pos == cur) {
+        pattern = PATTERN_SEQUENTIAL;
+    } else if (stride == f->pf_stride && stride < 0 && stride > -(off_t) f->bufsize) {
+        pattern = PATTERN_REVERSE;
+    } else if (stride == f->pf_stride && stride != 0) {
+        pattern = PATTERN_STRIDE;
+    } else {
+        pattern = PATTERN_RANDOM;
+    }
+    if (pattern == f->pf_pattern) {
+        f->pf_hits++;
+    } else {
+        f->pf_pattern = pattern;
+        f->pf_hits = 0;
+        f->pf_next = pos;
+    }
+    f->pf_last = pos;
+    f->pf_stride = stride;
+    /* Nothing to predict for random access. (We leave the kernel's
+     * read-around on: readers like reordercat61 eventually touch every
+     * block, and MADV_RANDOM made them slower on a cold cache.)
+     */
+    if (f->pf_hits < PATTERN_CONFIRM || pattern == PATTERN_RANDOM) {
+        return;
+    }
+
+    /* Page faults on a mapping already read around the faulting page in
+     * both directions, and hinting on top of that measured slower, so we
+     * only hint for pread, which gets no such help for backward or strided
+     * reads. Sparse strides aren't hinted either: a one-block hint per
+     * stride replaces the kernel's larger read-around with small reads.
+     * Direct I/O bypasses the page cache the hints would fill.
+     */
+    bool dense = pattern != PATTERN_STRIDE || (stride > 0 && stride < (off_t) f->bufsize);
+    if (f->mapped || !dense || f->dio_fd >= 0) {
+        return;
+    }
+    if (pattern == PATTERN_REVERSE) {
+        if (pos < f->pf_next + PREFETCH_WINDOW / 2) {
+            prefetch_range(f, f->pf_next - PREFETCH_WINDOW, f->pf_next);
+            f->pf_next -= PREFETCH_WINDOW;
+        }
+    } else if (pos + PREFETCH_WINDOW / 2 > f->pf_next) {
+        if (f->pf_next < pos) {
+            f->pf_next = pos;
+        }
+        prefetch_range(f, f->pf_next, f->pf_next + PREFETCH_WINDOW);
+        f->pf_next += PREFETCH_WINDOW;
+    }
+}
+
+/* This function switches a regular output file to the mapped writer. We
+ * only do this once a file seeks: out-of-order writes then become plain
+ * memcpys instead of a flush, lseek and write each, while sequential
+ * writers are better off with large write()s (on ext4 faulting in each
+ * new page of a shared mapping costs more than copying it with write).
+ * Any buffered data must already be flushed. The descriptor we are handed
+ * is usually write-only (a shell redirect), and a shared writable mapping
+ * needs read access too, so we reopen the file read/write. Returns false,
+ * leaving the file on the write() path, for append-mode files or if the
+ * file can't be reopened.
+ */
+bool map_writer_open(io61_file *f) {
+    int flags = fcntl(f->fd, F_GETFL);
+    f->stats[STAT_OTHER_CALLS] += 2;    // with the dup or open
+    if (flags == -1 || (flags & O_APPEND)) {
+        return false;
+    }
+    if ((flags & O_ACCMODE) == O_RDWR) {
+        f->wmap_fd = dup(f->fd);
+    } else {
+        char path[64];
+        snprintf(path, sizeof(path), "/proc/self/fd/%d", f->fd);
+        f->wmap_fd = open(path, O_RDWR);
+    }
+    if (f->wmap_fd < 0) {
+        return false;
+    }
+    // Writing starts at the descriptor's current offset, and we never
+    // shrink the file below the size it already has
+    f->wpos = lseek(f->fd, 0, SEEK_CUR);
+    f->stats[STAT_LSEEK_CALLS]++;
+    f->wfile_size = io61_filesize(f);
+    f->wend = f->wfile_size;
+    f->wmap_len = 0;
+    f->wmap = NULL;
+    if (f->wpos < 0) {
+        close(f->wmap_fd);
+        return false;
+    }
+    return true;
+}
+
+/* This function tears down the mapped writer: it unmaps the file, cuts
+ * it back to the size actually written and leaves the original
+ * descriptor's offset where writing stopped, so the file can be written
+ * through write() afterwards (and so whoever shares the descriptor, like
+ * a shell, continues in the right place).
+ */
+int map_writer_close(io61_file *f) {
+    int r = 0;
+    if (f->wmap) {
+        munmap(f->wmap, f->wmap_len);
+        f->stats[STAT_MMAP_CALLS]++;
+        f->wmap = NULL;
+    }
+    if (f->wfile_size != f->wend) {
+        f->stats[STAT_OTHER_CALLS]++;
+        if (ftruncate(f->wmap_fd, f->wend) < 0) {
+            r = -1;
+        }
+    }
+    if (lseek(f->fd, f->wpos, SEEK_SET) < 0) {
+        r = -1;
+    }
+    close(f->wmap_fd);
+    f->stats[STAT_LSEEK_CALLS]++;
+    f->stats[STAT_OTHER_CALLS]++;
+    f->wmap_fd = -1;
+    return r;
+}
+
+/* This function makes sure bytes up to offset `end` of the output file
+ * are mapped. It grows the file with ftruncate by at least WRITE_EXTENT
+ * bytes (and at least doubles it) so it happens rarely. If the file can't
+ * be grown or mapped we give up on the mapping and return false, and the
+ * caller falls back to write().
+ */
+bool map_writer_reserve(io61_file *f, off_t end) {
+    if (end <= f->wfile_size && (size_t) end <= f->wmap_len) {
+        return true;
+    }
+    if (end > f->wfile_size) {
+        off_t new_size = f->wfile_size * 2;
+        if (new_size < end) {
+            new_size = end;
+        }
+        new_size = (new_size + WRITE_EXTENT - 1) & ~((off_t) WRITE_EXTENT - 1);
+        if (ftruncate(f->wmap_fd, new_size) == 0) {
+            f->wfile_size = new_size;
+        }
+        f->stats[STAT_OTHER_CALLS]++;
+    }
+    /* Map well past the end of the file so the mapping rarely has to
+     * move; we never touch the part beyond wfile_size.
+     */
+    if (end <= f->wfile_size && (size_t) f->wfile_size > f->wmap_len) {
+        size_t len = WRITE_MAP_MIN;
+        while (len < (size_t) f->wfile_size) {
+            len *= 2;
+        }
+        char* m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, f->wmap_fd, 0);
+        f->stats[STAT_MMAP_CALLS]++;
+        if (m != MAP_FAILED) {
+            if (f->wmap) {
+                munmap(f->wmap, f->wmap_len);
+                f->stats[STAT_MMAP_CALLS]++;
+            }
+            f->wmap = m;
+            f->wmap_len = len;
+        }
+    }
+    if (end <= f->wfile_size && (size_t) end <= f->wmap_len) {
+        return true;
+    }
+    map_writer_close(f);
+    return false;
+}
+
+/* This function copies `sz` bytes to the current write offset of a mapped
+ * output file. Returns false if the mapping had to be abandoned, in which
+ * case nothing was written.
+ */
+bool map_writer_write(io61_file *f, const char* buf, size_t sz) {
+    if (!map_writer_reserve(f, f->wpos + sz)) {
+        return false;
+    }
+    memcpy(&f->wmap[f->wpos], buf, sz);
+    f->wpos += sz;
+    if (f->wpos > f->wend) {
+        f->wend = f->wpos;
+    }
+    return true;
+}
+
+/* This function finishes the io_uring write from write slot `slot`: it waits for
+ * it and writes whatever the kernel didn't (after a short write or an
+ * error) with write(), which is where an error would be reported. The
+ * slot is then empty.
+ */
+void uring_finish_write(io61_file *f, cache_slot* slot) {
+    if (!slot->writing) {
+        return;
+    }
+    slot->writing = false;
+    uring_wait(slot);
+    size_t done = slot->io_result > 0 ? slot->io_result : 0;
+    f->stats[STAT_BYTES_WRITTEN] += done;
+    if (done < slot->pos) {
+        struct iovec iov[1] = { { &slot->arr_buf[done], slot->pos - done } };
+        write_iov(f, iov, 1, -1);
+    }
+    slot->pos = 0;
+}
+
+/* This function finishes every io_uring write from `f`'s write slots.
+ */
+void uring_finish_writes(io61_file *f) {
+    for (int i = 0; i < f->nslots; i++) {
+        uring_finish_write(f, &f->cache[i]);
+    }
+}
+
+/* This function writes every dirty write cache slot back to the file.
+ * Slots are sorted by offset and each run of adjacent slots goes out
+ * as one pwritev. With io_uring all the runs go to the kernel with one
+ * io_uring_enter instead, and any that come back short are written again
+ * with pwritev. Afterwards the current slot stays active, empty, at the
+ * current write position; the rest are free.
+ */
+int write_back_blocks(io61_file *f) {
+    cache_slot* dirty[f->nslots];
+    int ndirty = 0;
+    for (int i = 0; i < f->nslots; i++) {
+        cache_slot* s = &f->cache[i];
+        if (s->is_active && s->pos > 0) {
+            // insertion sort by offset
+            int j = ndirty++;
+            while (j > 0 && dirty[j - 1]->offset > s->offset) {
+                dirty[j] = dirty[j - 1];
+                j--;
+            }
+            dirty[j] = s;
+        }
+    }
+    // run[k] is the index in dirty of the first slot of the kth run
+    struct iovec iov[ndirty];
+    int run[ndirty + 1];
+    int nruns = 0;
+    for (int i = 0; i < ndirty; i++) {
+        if (i == 0 || dirty[i - 1]->offset + (off_t) dirty[i - 1]->pos != dirty[i]->offset) {
+            run[nruns++] = i;
+        }
+        iov[i].iov_base = dirty[i]->arr_buf;
+        iov[i].iov_len = dirty[i]->pos;
+    }
+    run[nruns] = ndirty;
+    bool batch = f->uring && nruns > 1;
+    if (batch) {
+        for (int k = 0; k < nruns; k++) {
+            cache_slot* first = dirty[run[k]];
+            uring_queue(f, IORING_OP_WRITEV, &iov[run[k]], run[k + 1] - run[k],
+                        first->offset, first);
+        }
+        for (int k = 0; k < nruns; k++) {
+            uring_wait(dirty[run[k]]);
+        }
+    }
+    int r = 0;
+    for (int k = 0; k < nruns; k++) {
+        cache_slot* first = dirty[run[k]];
+        size_t len = 0;
+        for (int i = run[k]; i < run[k + 1]; i++) {
+            len += dirty[i]->pos;
+        }
+        if (batch && first->io_result == (int) len) {
+            f->stats[STAT_BYTES_WRITTEN] += len;
+            continue;
+        }
+        if (write_iov(f, &iov[run[k]], run[k + 1] - run[k], first->offset) != (ssize_t) len) {
+            r = -1;
+        }
+    }
+    cache_slot* curr_cache = get_curr_cache(f);
+    for (int i = 0; i < f->nslots; i++) {
+        f->cache[i].is_active = false;
+    }
+    curr_cache->offset += curr_cache->pos;
+    curr_cache->pos = 0;
+    curr_cache->is_active = true;
+    return r;
+}
+
+/* This function makes the write cache slot for file offset `off` current.
+ * It continues a slot whose data ends exactly at `off` if there is one.
+ * Otherwise it takes an empty slot, first writing everything back if
+ * there are none or if the new slot could overlap a dirty one (written
+ * back in offset order, overlapping slots could land in the wrong order).
+ */
+void write_block_at(io61_file *f, off_t off) {
+    cache_slot* free_slot = NULL;
+    bool conflict = false;
+    for (int i = 0; i < f->nslots; i++) {
+        cache_slot* s = &f->cache[i];
+        if (!s->is_active || s->pos == 0) {
+            if (!free_slot) {
+                free_slot = s;
+            }
+        } else if (s->offset + (off_t) s->pos == off && s->pos < f->bufsize) {
+            f->curr_cache = i;
+            return;
+        } else if (s->offset < off + (off_t) f->bufsize && off < s->offset + (off_t) f->bufsize) {
+            conflict = true;
+        }
+    }
+    if (!free_slot || conflict) {
+        write_back_blocks(f);
+        free_slot = get_curr_cache(f);
+    }
+    slot_attach(f, free_slot);
+    free_slot->offset = off;
+    free_slot->pos = 0;
+    free_slot->buff_size = f->bufsize;
+    free_slot->is_active = true;
+    f->curr_cache = free_slot - f->cache;
+}
+
+/* This function does the work of io61_flush. The library's own flushes
+ * (when a buffer fills, on seeks and on close) call it directly, so
+ * only the program's calls to io61_flush are counted.
+ */
+int flush_file(io61_file *f) {
+    fast_sync(f);
+    if (f->mode == O_RDONLY || (f->mode == O_RDWR && !f->rw)) {
+        return 0;
+    }
+    // Filtered files compress what they have into a frame
+    if (f->lz) {
+        int r = lz_emit(f);
+        return flush_file(f->lz->under) < 0 ? -1 : r;
+    }
+    /* Read/write files write their dirty ranges back and, like dirty
+     * blocks below, leave the descriptor at the current position. The
+     * blocks stay cached.
+     */
+    if (f->rw) {
+        int r = rw_write_back(f);
+        cache_slot* curr_cache = get_curr_cache(f);
+        off_t pos = curr_cache ? curr_cache->offset + (off_t) curr_cache->pos : 0;
+        f->stats[STAT_LSEEK_CALLS]++;
+        if (lseek(f->fd, pos, SEEK_SET) < 0) {
+            r = -1;
+        }
+        return r;
+    }
+    /* Direct writers write out the current block, wait for the blocks
+     * still being written, and move the descriptor to the write position.
+     */
+    if (f->dio_fd >= 0) {
+        cache_slot* curr_cache = get_curr_cache(f);
+        if (!curr_cache) {
+            return 0;
+        }
+        int r = dio_write(f, curr_cache);
+        for (int i = 0; i < f->nslots; i++) {
+            if (dio_finish(f, &f->cache[i]) < 0) {
+                r = -1;
+            }
+        }
+        f->stats[STAT_LSEEK_CALLS]++;
+        if (lseek(f->fd, curr_cache->offset + (off_t) curr_cache->pos, SEEK_SET) < 0) {
+            r = -1;
+        }
+        return r;
+    }
+    /* Mapped data is already in the file; just trim the preallocated
+     * extent so the file has its real size.
+     */
+    if (f->wmap_fd >= 0) {
+        if (f->wfile_size != f->wend) {
+            f->stats[STAT_OTHER_CALLS]++;
+            if (ftruncate(f->wmap_fd, f->wend) < 0) {
+                return -1;
+            }
+            f->wfile_size = f->wend;
+        }
+        return 0;
+    }
+    /* Dirty blocks go back to their offsets, then the descriptor is moved
+     * to the write position so anyone sharing it continues from there.
+     */
+    if (f->wblocks) {
+        int r = write_back_blocks(f);
+        f->stats[STAT_LSEEK_CALLS]++;
+        if (lseek(f->fd, get_curr_cache(f)->offset, SEEK_SET) < 0) {
+            r = -1;
+        }
+        return r;
+    }
+    // A background write holds data from before the current slot's
+    if (f->uring) {
+        uring_finish_writes(f);
+    }
+    int r = 0;
+    for (int i = 0; i < f->nslots; i++) {
+        cache_slot* curr_cache = &f->cache[i];
+        /* Cycle through each cache slot and write cache->pos bytes to the buffer.
+         * Because we increment pos for the bytes we add to the buffer, cache->pos
+         * will always be the # of bytes we have in our buffer so far.  Will usually
+         * be bufsize unless we are got our data from a buffer smaller than
+         * bufsize. A write to a pipe can come back short when a signal (or
+         * io_uring's completion work) interrupts it, so write_iov retries.
+         */
+        if (curr_cache->pos > 0) {
+            struct iovec iov[1] = { { curr_cache->arr_buf, curr_cache->pos } };
+            if (write_iov(f, iov, 1, -1) != (ssize_t) curr_cache->pos) {
+                r = -1;
+            }
+            curr_cache->pos = 0;
+        }
+    }
+    return r;
+}
+
+/* This function is called when the current write cache slot is full. In
+ * block mode writing continues in the slot for the following range.
+ * Direct writers write the block out and continue in the next slot,
+ * once that slot's own write has finished, so with io_uring up to all
+ * but one of their slots are being written at a time. Otherwise the
+ * buffer is flushed with write(). With io_uring the full slot is
+ * instead written in the background while slot 0 or 1, whichever it
+ * isn't, fills. That slot's own write is finished first, so only one
+ * write is ever in flight and they land in order.
+ */
+void write_slot_full(io61_file *f) {
+    cache_slot* curr_cache = get_curr_cache(f);
+    if (f->lz) {
+        lz_emit(f);
+    } else if (f->wblocks) {
+        write_block_at(f, curr_cache->offset + curr_cache->pos);
+    } else if (f->dio_fd >= 0) {
+        off_t pos = curr_cache->offset + (off_t) curr_cache->pos;
+        dio_write(f, curr_cache);
+        cache_slot* next = &f->cache[(f->curr_cache + 1) % f->nslots];
+        dio_finish(f, next);
+        slot_attach(f, next);
+        next->buff_size = f->bufsize;
+        next->is_active = true;
+        dio_place(f, next, pos);
+        f->curr_cache = next - f->cache;
+    } else if (f->uring && f->nslots >= 2 && f->curr_cache < 2) {
+        cache_slot* next = &f->cache[f->curr_cache ^ 1];
+        uring_finish_write(f, next);
+        uring_queue(f, IORING_OP_WRITE, curr_cache->arr_buf, curr_cache->pos, -1, curr_cache);
+        curr_cache->writing = true;
+        uring_enter(false);
+        slot_attach(f, next);
+        next->buff_size = f->bufsize;
+        next->pos = 0;
+        next->is_active = true;
+        f->curr_cache = next - f->cache;
+    } else {
+        flush_file(f);
+    }
+}
+
+/* This function copies up to `n` bytes from `inf` to `outf` inside the
+ * kernel. It starts with the first method that could apply to the two
+ * files and moves on to the next whenever one fails before copying
+ * anything. `off_in` points to the input position for seekable inputs,
+ * which is updated, or is NULL to use the input descriptor's offset;
+ * output always goes to the output descriptor's offset. Stops at end of
+ * file, or when a method that has copied data fails, leaving the rest to
+ * the buffered path. Returns the number of bytes copied.
+ */
+size_t copy_kernel(io61_file *inf, io61_file *outf, loff_t* off_in, size_t n) {
+    copy_method method = COPY_SPLICE;
+    if (inf->filesize != -1) {
+        method = outf->filesize != -1 ? COPY_RANGE : COPY_SENDFILE;
+    }
+    size_t done = 0;
+    size_t method_done = 0;
+    while (done < n && method != COPY_BUFFERED) {
+        size_t chunk = n - done < COPY_CHUNK ? n - done : COPY_CHUNK;
+        ssize_t r;
+        if (method == COPY_RANGE) {
+            r = copy_file_range(inf->fd, off_in, outf->fd, NULL, chunk, 0);
+        } else if (method == COPY_SENDFILE) {
+            off_t off = *off_in;
+            r = sendfile(outf->fd, inf->fd, &off, chunk);
+            *off_in = off;
+        } else {
+            r = splice(inf->fd, off_in, outf->fd, NULL, chunk, SPLICE_F_MOVE);
+        }
+        inf->stats[STAT_COPY_CALLS]++;
+        if (r > 0) {
+            done += r;
+            method_done += r;
+            inf->stats[STAT_BYTES_COPIED] += r;
+        } else if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r == 0 && !off_in) {
+            // the writer closed the pipe
+            break;
+        } else if (method_done == 0) {
+            // (a seekable input can't be at its end yet, since n is
+            // clipped to its size, so an empty result means no support)
+            method++;
+        } else {
+            break;
+        }
+    }
+    return done;
+}
+
+/* This function copies up to `n` bytes from `inf` to `outf` through our
+ * buffers. The input data is borrowed rather than read, so it is copied
+ * only once, into `outf`'s buffer (or not at all for large mapped
+ * stretches). If `buffered_only` is true it stops when the data `inf`
+ * has already buffered runs out instead of reading more. Sets `*error` if
+ * a write fails. Returns the number of bytes copied.
+ */
+size_t copy_buffered(io61_file *inf, io61_file *outf, size_t n,
+                     bool buffered_only, bool* error) {
+    size_t done = 0;
+    while (done < n) {
+        cache_slot* curr_cache = get_curr_cache(inf);
+        if (buffered_only && (!curr_cache || curr_cache->pos == curr_cache->buff_size)) {
+            break;
+        }
+        const char* data;
+        ssize_t avail = io61_borrow(inf, &data, n - done);
+        if (avail <= 0) {
+            break;
+        }
+        ssize_t w = io61_write(outf, data, avail);
+        if (w < 0) {
+            *error = true;
+            break;
+        }
+        io61_release(inf, w);
+        done += w;
+    }
+    return done;
+}
+
+/* This function looks for the next `delim` byte in the unread bytes of
+ * `f`'s current slot, filling the next slot first if the current one is
+ * used up. The search is a memchr, which glibc runs 16 or 32 bytes at a
+ * time with SSE2 or AVX2. Sets `*start` to the unread bytes and `*found`
+ * to whether the delimiter is among them, and returns how many bytes the
+ * caller may take: up to and including the delimiter, or the whole rest
+ * of the slot. Returns 0 at end of file.
+ */
+size_t scan_slot(io61_file *f, int delim, const unsigned char** start, bool* found) {
+    cache_slot* curr_cache = get_curr_cache(f);
+    if (!curr_cache || curr_cache->pos >= curr_cache->buff_size) {
+        off_t offset = curr_cache ? curr_cache->offset + (off_t) curr_cache->pos : 0;
+        curr_cache = fill_new_cache(f, offset);
+        if (curr_cache == NULL) {
+            *found = false;
+            return 0;
+        }
+    }
+    *start = &curr_cache->str_buf[curr_cache->pos];
+    size_t avail = curr_cache->buff_size - curr_cache->pos;
+    const unsigned char* end = (const unsigned char*) memchr(*start, delim, avail);
+    *found = end != NULL;
+    return end ? (size_t) (end - *start) + 1 : avail;
+}
+
+/* This function picks the default buffer size for a file from what it
+ * is: regular files get large buffers (at least REGULAR_BUFFER_SIZE, or
+ * st_blksize if the filesystem prefers more), pipes the pipe's current
+ * capacity so one read or write can move everything it holds, and
+ * terminals about a line. Anything else uses st_blksize.
+ */
+size_t default_buffer_size(io61_file *f) {
+    struct stat s;
+    size_t size = BUFFER_SIZE;
+    f->stats[STAT_OTHER_CALLS]++;
+    if (fstat(f->fd, &s) < 0) {
+        return size;
+    }
+    if (s.st_blksize > 0) {
+        size = s.st_blksize;
+    }
+    if (S_ISREG(s.st_mode)) {
+        size = size < REGULAR_BUFFER_SIZE ? REGULAR_BUFFER_SIZE : size;
+    } else if (S_ISFIFO(s.st_mode)) {
+        int r = fcntl(f->fd, F_GETPIPE_SZ);
+        f->stats[STAT_OTHER_CALLS]++;
+        if (r > 0) {
+            size = r;
+        }
+    } else if (isatty(f->fd)) {
+        size = TTY_BUFFER_SIZE;
+    }
+    return size < MAX_BUFFER_SIZE ? size : MAX_BUFFER_SIZE;
+}
+
+/* This function gives the buffers of all of `f`'s slots back to the pool.
+ */
+void free_slot_buffers(io61_file *f) {
+    for (int i = 0; i < f->nslots; i++) {
+        if (f->cache[i].arr_buf) {
+            pool_put(f, f->cache[i].arr_buf);
+            f->cache[i].arr_buf = NULL;
+        }
+    }
+}
+
+/* This function gives a file `nslots` empty cache slots of `bufsize`
+ * bytes (rounded up to a power of two, so finding a block takes a shift
+ * rather than a division) and a block index with at least twice as many
+ * buckets, so chains stay short. Any previous slots are freed.
+ */
+int alloc_cache(io61_file *f, size_t bufsize, int nslots) {
+    if (nslots < 1) {
+        nslots = 1;
+    }
+    int bufshift = 0;
+    while (((size_t) 1 << bufshift) < bufsize) {
+        bufshift++;
+    }
+    bufsize = (size_t) 1 << bufshift;
+    if (f->mapped && f->ino->map_size < f->filesize && bufsize > (size_t) f->ino->map_size) {
+        // A block must not straddle two windows
+        bufsize = f->ino->map_size;
+    }
+    unsigned nbuckets = 1;
+    while (nbuckets < 2 * (unsigned) nslots) {
+        nbuckets *= 2;
+    }
+    free_slot_buffers(f);
+    free(f->cache);
+    free(f->index);
+    f->cache = (cache_slot*) calloc(nslots, sizeof(cache_slot));
+    f->index = (int*) malloc(nbuckets * sizeof(int));
+    if (!f->cache || !f->index) {
+        return -1;
+    }
+    for (unsigned i = 0; i < nbuckets; i++) {
+        f->index[i] = -1;
+    }
+    f->nslots = nslots;
+    f->bufsize = bufsize;
+    f->bufshift = bufshift;
+    f->index_mask = nbuckets - 1;
+    f->clock_hand = 0;
+    return 0;
+}
+
+/* This function moves the read position of a seekable input to `offset`
+ * (at most the file size) by making the block holding it current. At end
+ * of file that is the end of the last block, since fill_new_cache has no
+ * block to return for the file size itself.
+ */
+void set_read_position(io61_file *f, off_t offset) {
+    if (offset == 0 || offset < f->filesize) {
+        fill_new_cache(f, offset);
+    } else if (fill_new_cache(f, offset - 1)) {
+        get_curr_cache(f)->pos++;
+    }
 }
 
-/* This function is used by io61_seek to check if there is currently a cache that
- * contains data located at the offset position into the file. If so then it returns
- * this cache to io61_seek and io61_seek adjusts the cache->pos accordingly before 
- * io61_read/readc are called.
+/* This function is used by io61_read to bypass the cache for large requests:
+ * when the current cache is used up and at least bufsize bytes are still
+ * wanted, they are read straight into the caller's `buf` instead of being
+ * copied through a cache slot. Pipes use readv to fill `buf` and the
+ * read-ahead buffer in one call, so the leftover of a large read is still
+ * buffered. Files read with pread read whole blocks directly and leave the
+ * last (partial) block to the cache, which keeps the position and block
+ * alignment. Mapped files don't need this since copying out of the mapping
+ * is the only copy, inputs with a prefetch thread must leave all reading
+ * to it, read/write files must see their buffered writes, filtered files
+ * have no file to read but their stream's, and direct I/O needs aligned
+ * buffers. Returns the number of bytes read into `buf`.
  */
-cache_slot* find_cache_offset(io61_file *f, size_t offset) {
-    cache_slot* curr_cache = NULL;
-    for (int i = 0; i < NUM_CACHE; i++) {
-        curr_cache = &f->cache[i];
-        // if our our desired offset in the file is contained within curr_cache's
-        // bounds then data we want is in this cache
-        if (curr_cache->is_active && curr_cache->offset <= offset &&
-            offset < curr_cache->offset + curr_cache->buff_size) {
-            
-            f->curr_cache = i;
-            return curr_cache;    
+size_t read_direct(io61_file *f, char* buf, size_t sz, off_t offset) {
+    if (sz < f->bufsize || f->mapped || f->bg_ok || f->rw || f->lz || f->dio_fd >= 0) {
+        return 0;
+    }
+    size_t got = 0;
+    if (f->filesize == -1) {
+        if (!f->ra_buf && !alloc_readahead(f)) {
+            return 0;
+        }
+        size_t extra = 0;
+        while (got < sz) {
+            struct iovec iov[2] = {
+                { &buf[got], sz - got }, { f->ra_buf, f->ra_size }
+            };
+            ssize_t r = readv(f->fd, iov, 2);
+            f->stats[STAT_READ_CALLS]++;
+            f->stats[STAT_BYTES_READ] += r > 0 ? r : 0;
+            if (r < 0 && errno == EINTR) {
+                continue;
+            } else if (r <= 0) {
+                return got;
+            } else if ((size_t) r > sz - got) {
+                extra = r - (sz - got);
+                r = sz - got;
+            }
+            got += r;
         }
+        // Whatever came in past the request is the next data to read
+        cache_slot* slot = &f->cache[0];
+        slot->str_buf = f->ra_buf;
+        slot->buff_size = extra;
+        slot->pos = 0;
+        slot->offset = offset + sz;
+        slot->is_active = true;
+        f->curr_cache = 0;
+        return got;
     }
-    return NULL;
+    // The block holding the last byte wanted (or the file's last byte) is
+    // left for the cache, so the position stays in a cache slot
+    size_t want = sz;
+    if (f->filesize - offset < (off_t) want) {
+        want = offset < f->filesize ? f->filesize - offset : 0;
+    }
+    if (want == 0) {
+        return 0;
+    }
+    size_t direct = ((want - 1) >> f->bufshift) << f->bufshift;
+    while (got < direct) {
+        ssize_t r = pread(f->fd, &buf[got], direct - got, offset + got);
+        f->stats[STAT_READ_CALLS]++;
+        f->stats[STAT_BYTES_READ] += r > 0 ? r : 0;
+        if (r < 0 && errno == EINTR) {
+            continue;
+        } else if (r <= 0) {
+            break;
+        }
+        got += r;
+    }
+    return got;
 }
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file that reads from and/or writes to the given
-//    file descriptor `fd`. `mode` is either O_RDONLY for a read-only file
-//    or O_WRONLY for a write-only file. You need not support read/write
-//    files.
+//    file descriptor `fd`. `mode` is O_RDONLY for a read-only file,
+//    O_WRONLY for a write-only file, or O_RDWR for a file that is both.
 
 io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
-    io61_file* f = (io61_file*) malloc(sizeof(io61_file));
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
     f->fd = fd;
     f->mode = mode;
+    f->stats[STAT_FILES] = 1;
+    f->next_open = open_files;
+    open_files = f;
     f->filesize = io61_filesize(f);
     f->curr_cache = -1;
-    f->cache_count = 0;
+    f->wmap_fd = -1;
+    f->dio_fd = -1;
+    f->rw = mode == O_RDWR && f->filesize != -1;
+    f->disk_size = f->filesize;
     if (f->filesize != -1) {
-        if (mode == O_RDONLY) {
-            f->file_data = mmap(NULL, f->filesize, PROT_READ, MAP_SHARED, fd, 0);
+        // Direct files never map, which would read through the page cache
+        bool direct = dio_open(f);
+        if (mode == O_RDONLY && f->filesize > 0) {
+            off_t end;
+            f->mapped = inode_get(f) && !direct && map_at(f, 0, &end) != NULL;
+        } else if (mode == O_WRONLY) {
+            f->wmap_ok = !direct;
         }
         f->file_offset = 0;
     }
+    const char* slots = getenv("IO61_SLOTS");
+    alloc_cache(f, f->dio_fd >= 0 ? DIRECT_BUFFER_SIZE : default_buffer_size(f),
+                slots ? atoi(slots) : NUM_CACHE);
+    // Only regular files that aren't mapped make system calls io_uring can take
+    f->uring = f->filesize != -1 && !f->mapped && !f->rw && uring_init(f->dio_fd >= 0);
+    const char* prefetch = getenv("IO61_PREFETCH");
+    f->bg_ok = mode == O_RDONLY && f->filesize == -1 && prefetch && atoi(prefetch);
     return f;
 }
 
 
+// io61_open_filter(f, filter)
+//    Return a new io61_file that passes what is read from or written to
+//    it through `filter`, reading from or writing to `f`, which it takes
+//    over (closing the new file closes `f`). With IO61_LZ, written data is
+//    compressed into frames of up to LZ61_FRAME bytes (see lz61.h) and read
+//    data decompressed; seeks are supported, if `f` can seek, by reading
+//    the frame holding the new position. Returns NULL if `filter` is
+//    unknown or `f` was opened O_RDWR.
+
+io61_file* io61_open_filter(io61_file* f, int filter) {
+    if (filter != IO61_LZ) {
+        return NULL;
+    }
+    io61_file* ff = (io61_file*) calloc(1, sizeof(io61_file));
+    if (!ff) {
+        return NULL;
+    }
+    ff->lz = lz61_open(f, f->mode);
+    if (!ff->lz || alloc_cache(ff, LZ61_FRAME, 1) < 0) {
+        if (ff->lz) {
+            ff->lz->under = NULL;
+            lz61_close(ff->lz);
+        }
+        free(ff->cache);
+        free(ff->index);
+        free(ff);
+        return NULL;
+    }
+    ff->fd = -1;
+    ff->mode = f->mode;
+    ff->stats[STAT_FILES] = 1;
+    ff->next_open = open_files;
+    open_files = ff;
+    ff->filesize = -1;
+    ff->curr_cache = -1;
+    ff->wmap_fd = -1;
+    ff->dio_fd = -1;
+    return ff;
+}
+
+
+// io61_setbuf(f, size, nslots)
+//    Use `nslots` cache slots of `size` bytes each for `f` (rounded up
+//    to a power of two); 0 keeps the current value. Like setvbuf, this
+//    must be called before `f` is read, written, or seeked. Returns 0 on
+//    success and -1 on failure.
+
+int io61_setbuf(io61_file* f, size_t size, int nslots) {
+    if (f->lz || f->curr_cache != -1 || f->ra_buf || f->wmap_fd >= 0 || f->wblocks) {
+        return -1;
+    }
+    return alloc_cache(f, size ? size : f->bufsize,
+                       nslots > 0 ? nslots : f->nslots);
+}
+
+
 // io61_close(f)
 //    Close the io61_file `f` and release all its resources, including
 //    any buffers.
 
 int io61_close(io61_file* f) {
-    io61_flush(f);
-    if (f->filesize != -1 && f->mode == O_RDONLY) {
-        munmap(f->file_data, f->filesize);
+    fast_sync(f);
+    flush_file(f);
+    // The kernel may still be reading ahead into our buffers
+    for (int i = 0; i < f->nslots; i++) {
+        if (f->cache[i].io_pending) {
+            uring_wait(&f->cache[i]);
+        }
+    }
+    if (f->bg) {
+        prefetch_stop(f);
+    }
+    if (f->ino) {
+        inode_put(f);
+    }
+    if (f->wmap_fd >= 0) {
+        map_writer_close(f);
+    }
+    free(f->ra_buf);
+    free(f->line_buf);
+    free_slot_buffers(f);
+    free(f->cache);
+    free(f->index);
+    if (f->dio_fd >= 0) {
+        close(f->dio_fd);
+        f->stats[STAT_OTHER_CALLS]++;
+    }
+    int r;
+    if (f->lz) {
+        r = lz61_close(f->lz);
+    } else {
+        r = close(f->fd);
+        f->stats[STAT_OTHER_CALLS]++;
+    }
+    io61_file** link = &open_files;
+    while (*link != f) {
+        link = &(*link)->next_open;
+    }
+    *link = f->next_open;
+    if (pool.hand == f) {
+        pool.hand = f->next_open;
+    }
+    for (int i = 0; i < NSTATS; i++) {
+        closed_stats[i] += f->stats[i];
     }
-    int r = close(f->fd);
     free(f);
     return r;
 }
 
 
-// io61_readc(f)
-//    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+// io61_readc_slow(f)
+//    Read a single (unsigned) character from `f` and return it, when the
+//    inline io61_readc has run out of buffered data. Returns EOF (which
+//    is -1) on error or end-of-file.
 
-int io61_readc(io61_file* f) {
-    // If there is no curr_cache, fill cache from the begining of the file    
-    if (!get_curr_cache(f)) {
-        cache_slot* new_cache = fill_new_cache(f, 0);
-        if (new_cache == NULL) {
-            return EOF;
-        }
-    }
-    
+int io61_readc_slow(io61_file* f) {
+    fast_sync(f);
     cache_slot* curr_cache = get_curr_cache(f);
-    // If cache->pos < cache->buff_size, we still have chars to read from buffer
-    if (curr_cache->pos < curr_cache->buff_size) {
-        if (f->filesize == -1) {
-            return curr_cache->arr_buf[curr_cache->pos++];
-        } else {
-            return curr_cache->str_buf[curr_cache->pos++];
-        }
-    } else {
-        /* If we have finished reading from the buffer, fill a new cache starting at the
-         * next block of data within the file and recursively call io61_readc.
-         */
-        cache_slot* new_cache = fill_new_cache(f, curr_cache->offset + curr_cache->pos);
-        if (new_cache == NULL) {
+    // Once a cache is used up, fill one starting at the next byte
+    if (!curr_cache || curr_cache->pos >= curr_cache->buff_size) {
+        off_t offset = curr_cache ? curr_cache->offset + (off_t) curr_cache->pos : 0;
+        curr_cache = fill_new_cache(f, offset);
+        if (curr_cache == NULL) {
             return EOF;
-        }       
-        return io61_readc(f);
+        }
     }
+    int ch = curr_cache->str_buf[curr_cache->pos++];
+    crc_add(f, &curr_cache->str_buf[curr_cache->pos - 1], 1);
+    fast_expose(f);
+    return ch;
 }
 
 
@@ -230,119 +2698,242 @@ int io61_readc(io61_file* f) {
 //    -1 an error occurred before any characters were read.
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
-    // If there is no curr_cache, fill cache from the begining of the file   
-    if (!get_curr_cache(f)) {
-        cache_slot* new_cache = fill_new_cache(f, 0);
-        if (new_cache == NULL) {
-            return 0;
-        }
+    // Reads the exposed buffer can satisfy need nothing else
+    if ((size_t) (f->buf.rend - f->buf.rpos) >= sz) {
+        memcpy(buf, f->buf.rpos, sz);
+        f->buf.rpos += sz;
+        return sz;
     }
-    
+    fast_sync(f);
+    // nread is total bytes read from the file so far
+    size_t nread = 0;
     cache_slot* curr_cache = get_curr_cache(f);
-    // If cache->pos < cache->buff_size, we still have chars to read from buffer
-    if (curr_cache->pos < curr_cache->buff_size) {
-        // nread is total bytes read from the file so far
-        size_t nread = 0;
-        // char_left is how many chars left to be read from buffer
-        size_t char_left = 0;
-        // total_char_left is how many chars left to be read from the file
-        size_t total_char_left = sz;
-        while (nread != sz) {
-            total_char_left -= nread;
-            char_left = curr_cache->buff_size - curr_cache->pos;
-            /* If chars left in buffer are less than chars left in file, we are not
-             * at the last block of the file yet so we just memcpy whats left of the
-             * buffer into our destination buf and increment nread and cache's pos.
-             */
-            if (char_left < total_char_left) {
-                if (f->filesize == -1) {
-                    memcpy(&buf[nread], &curr_cache->arr_buf[curr_cache->pos], char_left);
-                } else {
-                    memcpy(&buf[nread], &curr_cache->str_buf[curr_cache->pos], char_left);
-                }
-                    nread += char_left;
-                    curr_cache->pos += char_left;
-            } else {
-            /* Otherwise we just memcpy total_char_left bytes from our cache's buffer
-             * into our desintation buf and increment nread and cache's pos.
-             */
-                if (f->filesize == -1) {
-                    memcpy(&buf[nread], &curr_cache->arr_buf[curr_cache->pos], total_char_left);
-                } else {
-                    memcpy(&buf[nread], &curr_cache->str_buf[curr_cache->pos], total_char_left);
-                }
-                nread+= total_char_left;
-                curr_cache->pos += total_char_left;
+    while (nread != sz) {
+        /* If we have finished reading from the buffer (or have none yet) and still need
+         * more, first read whatever is large enough straight into buf, then fill a new
+         * cache starting at the next block of data within the file. (Filling when the
+         * request is already satisfied would block on a pipe whose writer is waiting for
+         * our reply.)
+         */
+        if (!curr_cache || curr_cache->pos >= curr_cache->buff_size) {
+            off_t offset = curr_cache ? curr_cache->offset + (off_t) curr_cache->pos : 0;
+            size_t direct = read_direct(f, &buf[nread], sz - nread, offset);
+            nread += direct;
+            if (nread == sz) {
+                break;
             }
-            /* If we have finished reading from the buffer, fill a new cache starting at the
-             * next block of data within the file and set curr_cache to the new cache we filled.
-             */
-            if (curr_cache->pos == curr_cache->buff_size) {
-                cache_slot* new_cache = fill_new_cache(f, curr_cache->offset + curr_cache->pos);
-                if (new_cache == NULL) {
-                    return nread;
-                }
-                curr_cache = new_cache;
+            curr_cache = fill_new_cache(f, offset + direct);
+            if (curr_cache == NULL) {
+                break;
             }
         }
-        return nread;
-    } else {
-        /* If for some reason the cache we filled at the begining didn't work we fill the next
-         * cache and recursively call io61_read.  We should not reach this case though.
+        /* Copy whatever we still need, up to what is left in the buffer, into our
+         * destination buf and increment nread and cache's pos.
          */
-        cache_slot* new_cache = fill_new_cache(f, curr_cache->offset + curr_cache->pos);
-        if (new_cache == NULL) {
-            return 0;
+        size_t char_left = curr_cache->buff_size - curr_cache->pos;
+        if (char_left > sz - nread) {
+            char_left = sz - nread;
         }
-        return io61_read(f, buf, sz);
+        memcpy(&buf[nread], &curr_cache->str_buf[curr_cache->pos], char_left);
+        nread += char_left;
+        curr_cache->pos += char_left;
     }
+    crc_add(f, buf, nread);
+    fast_expose(f);
+    return nread;
 }
 
 
-// io61_writec(f)
-//    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+// io61_borrow(f, ptr, maxsz)
+//    Set `*ptr` to the next unread bytes of `f` without copying them and
+//    return how many there are, at most `maxsz`. Returns 0 at end of file.
+//    The bytes stay unread until io61_release. For mapped files `*ptr`
+//    points into the mapping and may lend up to the end of the mapped
+//    window; otherwise it points into a buffer. Either way it is only
+//    valid until the next read.
 
-int io61_writec(io61_file* f, int ch) {
-    // If there is no curr_cache, set cache[0] as our current cache
-    if(!get_curr_cache(f)) {
-        f->curr_cache = 0;
-        f->cache[0].buff_size = BUFFER_SIZE;
-        f->cache[0].pos = 0;
-        f->cache[0].is_active = true;
+ssize_t io61_borrow(io61_file* f, const char** ptr, size_t maxsz) {
+    fast_sync(f);
+    cache_slot* curr_cache = get_curr_cache(f);
+    if (!curr_cache || curr_cache->pos >= curr_cache->buff_size) {
+        off_t offset = curr_cache ? curr_cache->offset + (off_t) curr_cache->pos : 0;
+        curr_cache = fill_new_cache(f, offset);
+        if (curr_cache == NULL) {
+            *ptr = NULL;
+            return 0;
+        }
+    }
+    size_t avail;
+    if (f->mapped) {
+        // The rest of the mapped window can be lent at once
+        off_t offset = curr_cache->offset + (off_t) curr_cache->pos;
+        off_t end;
+        *ptr = map_at(f, offset, &end);
+        avail = end - offset;
+    } else {
+        avail = curr_cache->buff_size - curr_cache->pos;
+        *ptr = (const char*) &curr_cache->str_buf[curr_cache->pos];
     }
+    f->lent = (const unsigned char*) *ptr;
+    return avail < maxsz ? avail : maxsz;
+}
+
+
+// io61_release(f, n)
+//    Mark `n` bytes returned by the last io61_borrow as read. Returns 0 on
+//    success and -1 if `n` is more than was borrowed.
+
+int io61_release(io61_file* f, size_t n) {
+    fast_sync(f);
     cache_slot* curr_cache = get_curr_cache(f);
-    /* If there are still chars left to fill in our buffer, put ch in pos
-     * and increment cache's pos.
-     */
-    if (curr_cache->pos < curr_cache->buff_size) {
-        curr_cache->arr_buf[curr_cache->pos] = ch;
-        curr_cache->pos++;
+    if (!curr_cache) {
+        return n ? -1 : 0;
+    }
+    if (curr_cache->pos + n <= curr_cache->buff_size) {
+        curr_cache->pos += n;
+        crc_add(f, f->lent, n);
         return 0;
-    } else {
-        /* If the cache is full then flush buffer and recursively call io61_writec
-         */
-        io61_flush(f);
-        return io61_writec(f, ch);
     }
+    off_t offset = curr_cache->offset + (off_t) (curr_cache->pos + n);
+    if (!f->mapped || offset > f->filesize) {
+        return -1;
+    }
+    // Mapped borrows can span blocks
+    set_read_position(f, offset);
+    crc_add(f, f->lent, n);
+    return 0;
 }
 
 
-// io61_write(f, buf, sz)
-//    Write `sz` characters from `buf` to `f`. Returns the number of
-//    characters written on success; normally this is `sz`. Returns -1 if
-//    an error occurred before any characters were written.
+// io61_readline(f, line, len)
+//    Read the next line of `f`, up to and including its newline (the last
+//    line may not have one). Sets `*line` to point at it and `*len` to its
+//    length, and returns the length; returns 0 at end of file. A line
+//    that lies within one buffer is returned in place, without copying;
+//    others are copied into a buffer of `f`'s. Either way `*line` is only
+//    valid until the next read.
 
-ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+ssize_t io61_readline(io61_file* f, const char** line, size_t* len) {
+    fast_sync(f);
+    size_t n = 0;
+    bool found = false;
+    while (!found) {
+        const unsigned char* start;
+        size_t take = scan_slot(f, '\n', &start, &found);
+        if (take == 0) {
+            break;
+        }
+        get_curr_cache(f)->pos += take;
+        crc_add(f, start, take);
+        if (found && n == 0) {
+            *line = (const char*) start;
+            *len = take;
+            return take;
+        }
+        if (n + take > f->line_cap) {
+            size_t cap = f->line_cap ? f->line_cap : BUFFER_SIZE;
+            while (cap < n + take) {
+                cap *= 2;
+            }
+            char* buf = (char*) realloc(f->line_buf, cap);
+            if (!buf) {
+                return -1;
+            }
+            f->line_buf = buf;
+            f->line_cap = cap;
+        }
+        memcpy(&f->line_buf[n], start, take);
+        n += take;
+    }
+    *line = n ? f->line_buf : NULL;
+    *len = n;
+    return n;
+}
+
+
+// io61_scan_until(f, delim)
+//    Skip over the data of `f` up to and including the next `delim` byte
+//    (or to end of file, if there is none). Returns the number of bytes
+//    skipped, which is 0 at end of file.
+
+ssize_t io61_scan_until(io61_file* f, int delim) {
+    fast_sync(f);
+    size_t n = 0;
+    bool found = false;
+    while (!found) {
+        const unsigned char* start;
+        size_t take = scan_slot(f, delim, &start, &found);
+        if (take == 0) {
+            break;
+        }
+        get_curr_cache(f)->pos += take;
+        crc_add(f, start, take);
+        n += take;
+    }
+    return n;
+}
+
+
+// io61_writec_slow(f, ch)
+//    Write a single character `ch` to `f`, when the inline io61_writec
+//    has run out of buffer space. Returns 0 on success or -1 on error.
+
+int io61_writec_slow(io61_file* f, int ch) {
+    char c = ch;
+    return io61_write(f, &c, 1) == 1 ? 0 : -1;
+}
+
+
+/* This function does the work of io61_write.
+ */
+ssize_t write_buffered(io61_file* f, const char* buf, size_t sz) {
+    if (f->mode == O_RDWR) {
+        return rw_write(f, buf, sz);
+    }
+    // Mapped output files are a single memcpy
+    if (f->wmap_fd >= 0 && map_writer_write(f, buf, sz)) {
+        return sz;
+    }
     // If there is no curr_cache, set cache[0] as our current cache
     if (!get_curr_cache(f)) {
+        slot_attach(f, &f->cache[0]);
         f->curr_cache = 0;
-        f->cache[0].buff_size = BUFFER_SIZE;
+        f->cache[0].buff_size = f->bufsize;
         f->cache[0].pos = 0;
         f->cache[0].is_active = true;
+        // Direct writers start at the descriptor's offset
+        if (f->dio_fd >= 0) {
+            f->stats[STAT_LSEEK_CALLS]++;
+            dio_place(f, &f->cache[0], lseek(f->fd, 0, SEEK_CUR));
+        }
     }
     
     cache_slot* curr_cache = get_curr_cache(f);
+    /* Requests of at least a buffer skip the copy into the buffer: anything
+     * already buffered goes out with them in one writev. Dirty blocks are
+     * written back first instead, and the data goes with pwrite to the
+     * current position. Filtered files must compress everything a frame
+     * at a time, and direct writers need the data in aligned buffers.
+     */
+    if (sz >= f->bufsize && !f->lz && f->dio_fd < 0) {
+        ssize_t w;
+        if (f->wblocks) {
+            write_back_blocks(f);
+            struct iovec iov[1] = { { (char*) buf, sz } };
+            w = write_iov(f, iov, 1, curr_cache->offset);
+            curr_cache->offset += sz;
+        } else {
+            if (f->uring) {
+                uring_finish_writes(f);
+            }
+            struct iovec iov[2] = {
+                { curr_cache->arr_buf, curr_cache->pos }, { (char*) buf, sz }
+            };
+            w = write_iov(f, iov, 2, -1);
+            curr_cache->pos = 0;
+        }
+        return w < 0 ? -1 : (ssize_t) sz;
+    }
     /* If there are still chars left to fill in our buffer, put ch in pos
      * and increment cache's pos.
      */
@@ -354,7 +2945,7 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
         // total_char_left is the number of chars left to write from buf
         size_t total_char_left = sz;
         while (nwritten != sz) {
-            total_char_left -= nwritten;
+            total_char_left = sz - nwritten;
             char_left = curr_cache->buff_size - curr_cache->pos;
             /* If chars left in buffer are less than chars left in file, we are not
              * at the last block of the file yet so we just memcpy char_left bytes
@@ -372,10 +2963,11 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
                 nwritten += total_char_left;
                 curr_cache->pos += total_char_left;
             }
-            /* If we have finished writing to the buffer, flush the cache which resets buffer.
+            /* If we have finished writing to the buffer, move on to a fresh buffer.
              */
             if (curr_cache->pos == curr_cache->buff_size) {
-                io61_flush(f);
+                write_slot_full(f);
+                curr_cache = get_curr_cache(f);
             }
         }
         return nwritten;
@@ -383,9 +2975,104 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
         /* If for some reason the cache we got from the first statment didnt work we flush 
          * the cache and recursively call io61_write.  We should not reach this case though.
          */
-        io61_flush(f);
-        return io61_write(f, buf, sz);
+        write_slot_full(f);
+        return write_buffered(f, buf, sz);
+    }
+}
+
+
+// io61_write(f, buf, sz)
+//    Write `sz` characters from `buf` to `f`. Returns the number of
+//    characters written on success; normally this is `sz`. Returns -1 if
+//    an error occurred before any characters were written.
+
+ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
+    // Writes that fit in the exposed buffer need nothing else
+    if ((size_t) (f->buf.wend - f->buf.wpos) >= sz) {
+        memcpy(f->buf.wpos, buf, sz);
+        f->buf.wpos += sz;
+        return sz;
+    }
+    fast_sync(f);
+    ssize_t w = write_buffered(f, buf, sz);
+    if (w > 0) {
+        crc_add(f, buf, w);
+    }
+    fast_expose(f);
+    return w;
+}
+
+
+// io61_copy(inf, outf, n)
+//    Copy up to `n` bytes from `inf` to `outf`, stopping early at end of
+//    file. Returns the number of bytes copied, or -1 if an error occurred
+//    before any were. Where the kernel can do the copy itself
+//    (copy_file_range, sendfile, or splice) the data never enters our
+//    buffers; otherwise it is copied through them.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t n) {
+    fast_sync(inf);
+    fast_sync(outf);
+    bool error = false;
+    size_t ncopied = 0;
+    /* Data already read from a pipe exists only in our buffer, so it goes
+     * first. Seekable inputs are copied from the file at our position.
+     */
+    if (inf->filesize == -1) {
+        ncopied = copy_buffered(inf, outf, n, true, &error);
+    }
+    /* Copies smaller than a buffer are cheaper through the buffers than
+     * as a system call each, and inputs with a prefetch thread must leave
+     * all reading to it. Read/write files may hold writes the kernel
+     * can't see, or blocks it would make stale, so they are copied
+     * through the buffers too, as are filtered files, whose data the
+     * kernel never sees, files keeping checksums, which must see the
+     * data, and direct files, whose data must stay out of the page cache.
+     * For larger ones the kernel writes at the output descriptor's
+     * offset, so buffered output must be written out first. The mapped
+     * writer keeps its position to itself, so it is shut down and later
+     * writes use write().
+     */
+    if (!error && n - ncopied >= outf->bufsize && !inf->bg_ok && !inf->rw && !outf->rw
+        && !inf->lz && !outf->lz && !inf->checksum && !outf->checksum
+        && inf->dio_fd < 0 && outf->dio_fd < 0) {
+        int r;
+        if (outf->wmap_fd >= 0) {
+            outf->wmap_ok = false;
+            r = map_writer_close(outf);
+        } else {
+            r = flush_file(outf);
+        }
+        if (r < 0) {
+            return ncopied ? (ssize_t) ncopied : -1;
+        }
+        loff_t in_pos = 0;
+        loff_t* off_in = NULL;
+        size_t want = n - ncopied;
+        cache_slot* curr_cache = get_curr_cache(inf);
+        if (inf->filesize != -1) {
+            in_pos = curr_cache ? curr_cache->offset + curr_cache->pos : 0;
+            off_in = &in_pos;
+            if ((size_t) (inf->filesize - in_pos) < want) {
+                want = inf->filesize - in_pos;
+            }
+        }
+        size_t copied = copy_kernel(inf, outf, off_in, want);
+        ncopied += copied;
+        // Move both files' positions past what the kernel copied
+        if (copied && off_in) {
+            set_read_position(inf, in_pos);
+        } else if (copied && curr_cache) {
+            curr_cache->offset += copied;
+        }
+        if (copied && outf->wblocks) {
+            get_curr_cache(outf)->offset += copied;
+        }
     }
+    if (!error && ncopied < n) {
+        ncopied += copy_buffered(inf, outf, n - ncopied, false, &error);
+    }
+    return error && ncopied == 0 ? -1 : (ssize_t) ncopied;
 }
 
 
@@ -395,68 +3082,144 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 //    data buffered for reading, or do nothing.
 
 int io61_flush(io61_file* f) {
-    if (f->mode != O_WRONLY) {
-        return 0;
+    if (f->mode == O_WRONLY || f->rw) {
+        f->stats[STAT_FLUSHES]++;
     }
-    for (int i = 0; i < NUM_CACHE; i++) {
-        cache_slot* curr_cache = &f->cache[i];
-        /* Cycle through each cache slot and write cache->pos bytes to the buffer.
-         * Because we increment pos for the bytes we add to the buffer, cache->pos
-         * will always be the # of bytes we have in our buffer so far.  Will usually
-         * be BUFFER_SIZE unless we are got our data from a buffer smaller than
-         * BUFFER_SIZE.
-         */
-        if (curr_cache->pos > 0) {
-            write(f->fd, curr_cache->arr_buf, curr_cache->pos);
-            curr_cache->pos = 0;
+    return flush_file(f);
+}
+
+
+/* This function takes `f` off direct I/O, for io61_seek: direct I/O is
+ * for streaming, and data read or written out of order is what the page
+ * cache is for. Writers write everything out first, and reads in flight
+ * are waited for. The file then carries on as if it had been opened
+ * without IO61_DIRECT, with buffers of the usual size, mapped if it is
+ * an input, and with the mapped writer to come if it is an output.
+ */
+void dio_stop(io61_file *f) {
+    if (f->mode == O_WRONLY) {
+        flush_file(f);
+    }
+    for (int i = 0; i < f->nslots; i++) {
+        if (f->cache[i].io_pending) {
+            uring_wait(&f->cache[i]);
         }
     }
-    return 0;
+    close(f->dio_fd);
+    f->stats[STAT_OTHER_CALLS]++;
+    f->dio_fd = -1;
+    if (f->mode == O_RDONLY) {
+        off_t end;
+        f->mapped = f->ino && map_at(f, 0, &end) != NULL;
+        f->uring = f->uring && !f->mapped;
+    } else {
+        f->wmap_ok = true;
+    }
+    alloc_cache(f, default_buffer_size(f), f->nslots);
+    f->curr_cache = -1;
 }
 
+/* This function does the work of io61_seek.
+ */
+int seek_to(io61_file* f, off_t pos) {
+    // Filtered inputs find the frame holding pos; outputs can't seek
+    if (f->lz) {
+        return f->mode == O_RDONLY && pos >= 0 ? lz_fill(f, pos, true) : -1;
+    }
+    // Regular output files switch to the mapped writer on their first seek
+    if (f->wmap_ok) {
+        f->wmap_ok = false;
+        flush_file(f);
+        map_writer_open(f);
+    }
+    // Mapped output files just move the write offset
+    if (f->wmap_fd >= 0) {
+        if (pos < 0) {
+            return -1;
+        }
+        f->wpos = pos;
+        return 0;
+    }
+    // Read/write files make the block at pos current without flushing
+    if (f->rw) {
+        if (pos < 0) {
+            return -1;
+        }
+        cache_slot* curr_cache = get_curr_cache(f);
+        predict_access(f, pos, curr_cache ? curr_cache->offset + (off_t) curr_cache->pos : -1);
+        return rw_block_at(f, pos) ? 0 : -1;
+    }
+    // Other seekable outputs keep dirty blocks for each position
+    if (f->wblocks) {
+        if (pos < 0) {
+            return -1;
+        }
+        write_block_at(f, pos);
+        return 0;
+    }
+    /* Direct files stay direct for seeks to where they already are (or,
+     * for writers, seeks before the first write, which just say where
+     * writing starts). Any other seek ends direct I/O.
+     */
+    if (f->dio_fd >= 0) {
+        cache_slot* curr_cache = get_curr_cache(f);
+        if (!curr_cache && f->mode == O_WRONLY) {
+            f->stats[STAT_LSEEK_CALLS]++;
+            return lseek(f->fd, pos, SEEK_SET) == pos ? 0 : -1;
+        } else if (curr_cache && pos != curr_cache->offset + (off_t) curr_cache->pos) {
+            dio_stop(f);
+        } else if (f->mode == O_WRONLY) {
+            return 0;
+        }
+    }
+    // Buffered writes belong at the old position, so flush them first
+    if (f->mode == O_WRONLY) {
+        flush_file(f);
+    }
+    /* Inputs of unknown size have just the one cache, so a seek back into
+     * what it holds is served from it. The descriptor already sits at the
+     * end of that data, which is where the next fill continues.
+     */
+    if (f->mode == O_RDONLY && f->filesize == -1) {
+        cache_slot* curr_cache = find_cache_offset(f, pos);
+        if (curr_cache) {
+            curr_cache->pos = pos - curr_cache->offset;
+            return 0;
+        }
+    }
+    /* Reads from seekable files come from the mapping or pread and never
+     * use the descriptor's offset, so they don't need an lseek.
+     */
+    off_t r = pos;
+    if (f->mode != O_RDONLY || f->filesize == -1) {
+        r = lseek(f->fd, (off_t) pos, SEEK_SET);
+        f->stats[STAT_LSEEK_CALLS]++;
+    }
+    /* A seekable output switches to dirty blocks, unless it appends: then
+     * every write goes to the end anyway, so it must stay in program order.
+     */
+    if (f->mode == O_WRONLY && r == pos && !(fcntl(f->fd, F_GETFL) & O_APPEND)) {
+        f->stats[STAT_OTHER_CALLS]++;
+        f->wblocks = true;
+        write_block_at(f, pos);
+    }
 
-// io61_seek(f, pos)
-//    Change the file pointer for file `f` to `pos` bytes into the file.
-//    Returns 0 on success and -1 on failure.
-
-int io61_seek(io61_file* f, off_t pos) {
-    off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);    
-    
     if (f->mode == O_RDONLY) {
         
         cache_slot* curr_cache = get_curr_cache(f);
-        // Check if our curr_cache's offset in the file is 1 byte past our new
-        // desired offset.  Then we know we are looking at the file in reverse
-        // and can fill our cache more efficiently
-        if (curr_cache) {
-            int pos_diff = pos - (curr_cache->offset + curr_cache->pos - 1);
-            if (pos_diff == -1 && !find_cache_offset(f, pos + pos_diff)) {
-                cache_slot* new_cache;
-                if (pos < BUFFER_SIZE) {
-                    new_cache = fill_new_cache(f, 0);
-                } else {
-                    new_cache = fill_new_cache(f, pos - BUFFER_SIZE + 1);
-                }
-                if (new_cache == NULL) {
-                    return 0;
-                }
-            }
-        } 
-        
-        // If there is not cache which contains data within its buffer at pos
-        // offset from the begining of the file, create a cache with that offset
-        if (!find_cache_offset(f, pos)) {
-            cache_slot* new_cache = fill_new_cache(f, pos);
-            if (new_cache == NULL) {
-                return 0;
-            }
+        if (f->filesize != -1) {
+            off_t cur = curr_cache ? (off_t) (curr_cache->offset + curr_cache->pos) : -1;
+            predict_access(f, pos, cur);
+        }
+
+        // Make the cache holding the block at pos current, filling one if no cache
+        // has it yet, with its pos at the correct byte within the buffer (a
+        // seek to the end of a seekable file lands at the end of its last block)
+        if (f->filesize != -1) {
+            set_read_position(f, pos);
+        } else if (fill_new_cache(f, pos) == NULL) {
+            return 0;
         }
-        // Get current cache for this offset pos and adjust the pos value to the 
-        // correct byte within the buffer
-        curr_cache = get_curr_cache(f);
-        curr_cache->pos = pos - curr_cache->offset;
-    } else {
-        io61_flush(f);
     }
     if (r == (off_t) pos)
         return 0;
@@ -465,6 +3228,85 @@ int io61_seek(io61_file* f, off_t pos) {
 }
 
 
+// io61_seek(f, pos)
+//    Change the file pointer for file `f` to `pos` bytes into the file.
+//    Returns 0 on success and -1 on failure.
+
+int io61_seek(io61_file* f, off_t pos) {
+    f->stats[STAT_SEEKS]++;
+    /* The exposed buffer of a mapped output file is the whole mapping, so
+     * a seek within it just moves the write pointer.
+     */
+    unsigned char* wmap = (unsigned char*) f->wmap;
+    if (f->buf.wpos && f->wmap_fd >= 0 && pos >= 0 && pos < f->buf.wend - wmap) {
+        if (f->buf.wpos - wmap > f->wend) {
+            f->wend = f->buf.wpos - wmap;
+        }
+        crc_fold(f);
+        f->buf.wpos = &wmap[pos];
+        f->crc_from = f->buf.wpos;
+        return 0;
+    }
+    fast_sync(f);
+    int r = seek_to(f, pos);
+    fast_expose(f);
+    return r;
+}
+
+
+// io61_setchecksum(f, enable)
+//    Start keeping a CRC32C of the data read from or written to `f` from
+//    now on (if `enable` is nonzero), or stop. Returns 0.
+
+int io61_setchecksum(io61_file* f, int enable) {
+    fast_sync(f);
+    f->checksum = enable != 0;
+    f->crc = 0;
+    fast_expose(f);
+    return 0;
+}
+
+
+// io61_checksum(f)
+//    Return the CRC32C of the data read from or written to `f` since
+//    io61_setchecksum, in the order it was read or written. The CRC is
+//    computed as data moves through io61, so this costs nothing extra.
+
+uint32_t io61_checksum(io61_file* f) {
+    fast_sync(f);
+    fast_expose(f);
+    return f->crc;
+}
+
+
+// io61_profile_stats(buf, size)
+//    Write io61's counters, added up over every file opened so far, to
+//    `buf` as JSON members ("name":value pairs separated by ", "). Like
+//    snprintf, writes at most `size` bytes including the terminating null
+//    and returns the length of the whole report.
+
+int io61_profile_stats(char* buf, size_t size) {
+    unsigned long long total[NSTATS];
+    memcpy(total, closed_stats, sizeof(total));
+    for (io61_file* f = open_files; f; f = f->next_open) {
+        for (int i = 0; i < NSTATS; i++) {
+            total[i] += f->stats[i];
+        }
+        if (f->bg) {
+            total[STAT_READ_CALLS] += __atomic_load_n(&f->bg->nreads, __ATOMIC_RELAXED);
+            total[STAT_BYTES_READ] += __atomic_load_n(&f->bg->nbytes, __ATOMIC_RELAXED);
+        }
+    }
+    int len = 0;
+    for (int i = 0; i < NSTATS; i++) {
+        bool room = (size_t) len < size;
+        len += snprintf(room ? &buf[len] : NULL, room ? size - len : 0, "%s\"%s\":%llu",
+                        i ? ", " : "", stat_names[i], total[i]);
+    }
+    return len;
+}
+
+
 // You shouldn't need to change these functions.
 
 // io61_open_check(filename, mode)
@@ -496,6 +3338,7 @@ io61_file* io61_open_check(const char* filename, int mode) {
 off_t io61_filesize(io61_file* f) {
     struct stat s;
     int r = fstat(f->fd, &s);
+    f->stats[STAT_OTHER_CALLS]++;
     if (r >= 0 && S_ISREG(s.st_mode))
         return s.st_size;
     else
@@ -508,8 +3351,12 @@ off_t io61_filesize(io61_file* f) {
 //    immediately after a `read` call that returned 0 or -1.
 
 int io61_eof(io61_file* f) {
+    if (f->lz) {
+        return !f->lz->error;
+    }
     char x;
     ssize_t nread = read(f->fd, &x, 1);
+    f->stats[STAT_READ_CALLS]++;
     if (nread == 1) {
         fprintf(stderr, "Error: io61_eof called improperly\n\
   (Only call immediately after a read() that returned 0 or -1.)\n");
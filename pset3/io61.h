@@ -6,27 +6,76 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdint.h>
 
 typedef struct io61_file io61_file;
 
+// io61_buffer
+//    Every io61_file starts with one of these, so io61_readc and
+//    io61_writec can work inline on the current buffer in the common case:
+//    bytes [rpos, rend) can be read and [wpos, wend) can be written. When
+//    they are used up (or NULL), the out-of-line functions take over.
+
+typedef struct io61_buffer {
+    unsigned char* rpos;
+    unsigned char* rend;
+    unsigned char* wpos;
+    unsigned char* wend;
+} io61_buffer;
+
 io61_file* io61_fdopen(int fd, int mode);
 io61_file* io61_open_check(const char* filename, int mode);
 int io61_close(io61_file* f);
+int io61_setbuf(io61_file* f, size_t size, int nslots);
+
+// Filters for io61_open_filter
+#define IO61_LZ 1
+
+io61_file* io61_open_filter(io61_file* f, int filter);
 
 off_t io61_filesize(io61_file* f);
 
 int io61_seek(io61_file* f, off_t pos);
 
-int io61_readc(io61_file* f);
-int io61_writec(io61_file* f, int ch);
+int io61_readc_slow(io61_file* f);
+int io61_writec_slow(io61_file* f, int ch);
+
+static inline int io61_readc(io61_file* f) {
+    io61_buffer* b = (io61_buffer*) f;
+    if (b->rpos != b->rend) {
+        return *b->rpos++;
+    }
+    return io61_readc_slow(f);
+}
+
+static inline int io61_writec(io61_file* f, int ch) {
+    io61_buffer* b = (io61_buffer*) f;
+    if (b->wpos != b->wend) {
+        *b->wpos++ = ch;
+        return 0;
+    }
+    return io61_writec_slow(f, ch);
+}
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz);
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz);
 
+ssize_t io61_borrow(io61_file* f, const char** ptr, size_t maxsz);
+int io61_release(io61_file* f, size_t n);
+
+ssize_t io61_readline(io61_file* f, const char** line, size_t* len);
+ssize_t io61_scan_until(io61_file* f, int delim);
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t n);
+
+int io61_setchecksum(io61_file* f, int enable);
+uint32_t io61_checksum(io61_file* f);
+
 int io61_eof(io61_file* f);
 int io61_flush(io61_file* f);
 
 void io61_profile_begin(void);
 void io61_profile_end(void);
+int io61_profile_stats(char* buf, size_t size);
 
 #endif
@@ -0,0 +1,39 @@
+#include "io61.h"
+
+// Usage: ./linecat61 [-s] [FILE]
+//    Copies the input FILE to standard output a line at a time, using
+//    io61_readline. With -s, only every other line is copied; the lines
+//    in between are skipped with io61_scan_until.
+
+int main(int argc, char** argv) {
+    // Parse arguments
+    int skip = 0;
+    while (argc >= 2) {
+        if (strcmp(argv[1], "-s") == 0) {
+            skip = 1;
+            --argc, ++argv;
+        } else
+            break;
+    }
+
+    // Open files
+    const char* in_filename = argc >= 2 ? argv[1] : NULL;
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(in_filename, O_RDONLY);
+    io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+
+    // Copy lines
+    while (1) {
+        const char* line;
+        size_t len;
+        if (io61_readline(inf, &line, &len) <= 0)
+            break;
+        io61_write(outf, line, len);
+        if (skip && io61_scan_until(inf, '\n') <= 0)
+            break;
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
@@ -0,0 +1,457 @@
+#include "lz61.h"
+#include <stdint.h>
+
+// lz61.c
+//    The IO61_LZ codec and frame format (see lz61.h).
+
+/* Matches are at least LZ61_MIN_MATCH bytes and at most LZ61_MAX_OFFSET
+ * bytes back. The compressor finds them through a hash table of
+ * 1 << LZ61_HASH_BITS chains of earlier positions with the same next 4
+ * bytes, and looks at most LZ61_MAX_CHAIN positions down each chain.
+ * A compressed frame never needs more than LZ61_PACKED_MAX bytes.
+ */
+#define LZ61_MIN_MATCH 4
+#define LZ61_MAX_OFFSET 65535
+#define LZ61_HASH_BITS 15
+#define LZ61_MAX_CHAIN 32
+#define LZ61_PACKED_MAX (LZ61_FRAME + LZ61_FRAME / 255 + 16)
+#define LZ61_STORED 0x80000000U
+
+/* head[h] is the latest position in the frame whose next 4 bytes hash
+ * to h, and prev[i] the position before i with the same hash, or -1.
+ */
+struct lz61_matcher {
+    int32_t head[1 << LZ61_HASH_BITS];
+    int32_t prev[LZ61_FRAME];
+};
+
+/* This function returns the 4 bytes at `p` as a number.
+ */
+static uint32_t lz_load32(const unsigned char* p) {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+/* This function returns the hash chain for the 4 bytes at `p`.
+ */
+static uint32_t lz_hash(const unsigned char* p) {
+    return (lz_load32(p) * 2654435761U) >> (32 - LZ61_HASH_BITS);
+}
+
+/* This function returns how many bytes at `a` and `b` are equal, up to
+ * `max`, comparing 8 bytes at a time. (On little-endian machines the
+ * first differing byte is the lowest set bit of the difference.)
+ */
+static size_t lz_match_length(const unsigned char* a, const unsigned char* b, size_t max) {
+    size_t n = 0;
+    while (n + 8 <= max) {
+        uint64_t x, y;
+        memcpy(&x, &a[n], 8);
+        memcpy(&y, &b[n], 8);
+        if (x != y) {
+            return n + (__builtin_ctzll(x ^ y) >> 3);
+        }
+        n += 8;
+    }
+    while (n < max && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+/* This function writes the part of a length beyond a token's 15 to
+ * `out` and returns where it ends.
+ */
+static unsigned char* lz_put_length(unsigned char* out, size_t n) {
+    while (n >= 255) {
+        *out++ = 255;
+        n -= 255;
+    }
+    *out++ = n;
+    return out;
+}
+
+/* This function writes a sequence to `out`: `nlit` literal bytes from
+ * `lit`, then a match of `mlen` bytes `off` bytes back, or no match if
+ * `mlen` is 0 (only the last sequence of a frame). Returns where it ends.
+ */
+static unsigned char* lz_put_sequence(unsigned char* out, const unsigned char* lit,
+                                      size_t nlit, size_t off, size_t mlen) {
+    size_t extra = mlen ? mlen - LZ61_MIN_MATCH : 0;
+    unsigned char* token = out++;
+    *token = (nlit < 15 ? nlit : 15) << 4 | (extra < 15 ? extra : 15);
+    if (nlit >= 15) {
+        out = lz_put_length(out, nlit - 15);
+    }
+    memcpy(out, lit, nlit);
+    out += nlit;
+    if (mlen) {
+        *out++ = off & 255;
+        *out++ = off >> 8;
+        if (extra >= 15) {
+            out = lz_put_length(out, extra - 15);
+        }
+    }
+    return out;
+}
+
+/* This function compresses the `n` bytes at `src` (at most LZ61_FRAME)
+ * into `dst`, which has room for LZ61_PACKED_MAX bytes, and returns the
+ * compressed length. At each position it takes the longest match the
+ * hash chain offers, or a literal if there is none; every position is
+ * added to the chains, including those inside matches.
+ */
+static size_t lz_compress(lz61_matcher* m, const unsigned char* src, size_t n, unsigned char* dst) {
+    memset(m->head, 0xFF, sizeof(m->head));
+    unsigned char* out = dst;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + LZ61_MIN_MATCH <= n) {
+        uint32_t h = lz_hash(&src[i]);
+        int32_t cand = m->head[h];
+        m->prev[i] = cand;
+        m->head[h] = i;
+        size_t best = 0;
+        size_t best_off = 0;
+        for (int depth = 0; cand >= 0 && i - cand <= LZ61_MAX_OFFSET && depth < LZ61_MAX_CHAIN;
+             depth++, cand = m->prev[cand]) {
+            // a match can only be longer if it agrees one byte further
+            if (src[cand + best] != src[i + best]) {
+                continue;
+            }
+            size_t len = lz_match_length(&src[cand], &src[i], n - i);
+            if (len > best) {
+                best = len;
+                best_off = i - cand;
+                if (len == n - i) {
+                    break;
+                }
+            }
+        }
+        if (best < LZ61_MIN_MATCH) {
+            i++;
+            continue;
+        }
+        out = lz_put_sequence(out, &src[anchor], i - anchor, best_off, best);
+        size_t end = i + best;
+        for (i++; i < end && i + LZ61_MIN_MATCH <= n; i++) {
+            h = lz_hash(&src[i]);
+            m->prev[i] = m->head[h];
+            m->head[h] = i;
+        }
+        i = anchor = end;
+    }
+    out = lz_put_sequence(out, &src[anchor], n - anchor, 0, 0);
+    return out - dst;
+}
+
+/* This function adds the length bytes at `*src` (before `end`) to `*n`
+ * and moves `*src` past them. Returns false if they run past `end`.
+ */
+static bool lz_get_length(const unsigned char** src, const unsigned char* end, size_t* n) {
+    unsigned char b;
+    do {
+        if (*src == end) {
+            return false;
+        }
+        b = *(*src)++;
+        *n += b;
+    } while (b == 255);
+    return true;
+}
+
+/* This function decompresses the `n` bytes at `src` into `dst`, which
+ * has room for `cap` bytes. Returns the decompressed length, or -1 if the
+ * data is corrupt.
+ */
+static ssize_t lz_decompress(const unsigned char* src, size_t n, unsigned char* dst, size_t cap) {
+    const unsigned char* end = src + n;
+    size_t out = 0;
+    while (src < end) {
+        unsigned token = *src++;
+        size_t nlit = token >> 4;
+        if ((nlit == 15 && !lz_get_length(&src, end, &nlit))
+            || nlit > (size_t) (end - src) || nlit > cap - out) {
+            return -1;
+        }
+        memcpy(&dst[out], src, nlit);
+        src += nlit;
+        out += nlit;
+        if (src == end) {
+            break;
+        } else if (end - src < 2) {
+            return -1;
+        }
+        size_t off = src[0] | src[1] << 8;
+        src += 2;
+        size_t mlen = token & 15;
+        if ((mlen == 15 && !lz_get_length(&src, end, &mlen))
+            || off == 0 || off > out || mlen + LZ61_MIN_MATCH > cap - out) {
+            return -1;
+        }
+        mlen += LZ61_MIN_MATCH;
+        if (off >= mlen) {
+            memcpy(&dst[out], &dst[out - off], mlen);
+        } else {
+            // the match overlaps itself, repeating the last `off` bytes
+            for (size_t j = 0; j < mlen; j++) {
+                dst[out + j] = dst[out - off + j];
+            }
+        }
+        out += mlen;
+    }
+    return out;
+}
+
+/* This function stores `x` at `p` as 4 little-endian bytes.
+ */
+static void lz_put32(unsigned char* p, uint32_t x) {
+    p[0] = x;
+    p[1] = x >> 8;
+    p[2] = x >> 16;
+    p[3] = x >> 24;
+}
+
+/* This function returns the 4 little-endian bytes at `p`.
+ */
+static uint32_t lz_get32(const unsigned char* p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+/* This function reads the header of the frame at the current position of
+ * `s->under`, setting `*raw` to its data length, `*plen` to the length of
+ * what follows, and `*stored` to whether that is stored uncompressed.
+ * Returns 1, 0 at the end of the stream, or -1 if the header is corrupt.
+ */
+static int lz_read_header(lz61_stream* s, size_t* raw, size_t* plen, bool* stored) {
+    unsigned char h[LZ61_HEADER];
+    ssize_t r = io61_read(s->under, (char*) h, LZ61_HEADER);
+    if (r == 0) {
+        return 0;
+    } else if (r != LZ61_HEADER) {
+        return -1;
+    }
+    s->at += LZ61_HEADER;
+    uint32_t p = lz_get32(&h[4]);
+    *raw = lz_get32(h);
+    *plen = p & ~LZ61_STORED;
+    *stored = (p & LZ61_STORED) != 0;
+    if (*raw == 0 || *raw > LZ61_FRAME || *plen > LZ61_PACKED_MAX || (*stored && *plen != *raw)) {
+        return -1;
+    }
+    return 1;
+}
+
+/* This function records that frame nframes, of `raw` bytes and `plen`
+ * after its header, exists. Returns false if out of memory.
+ */
+static bool lz_add_frame(lz61_stream* s, size_t raw, size_t plen) {
+    if (s->nframes + 1 == s->frames_cap) {
+        int cap = s->frames_cap * 2;
+        off_t* starts = (off_t*) realloc(s->starts, cap * sizeof(off_t));
+        if (starts) {
+            s->starts = starts;
+        }
+        off_t* packed_at = (off_t*) realloc(s->packed_at, cap * sizeof(off_t));
+        if (packed_at) {
+            s->packed_at = packed_at;
+        }
+        if (!starts || !packed_at) {
+            return false;
+        }
+        s->frames_cap = cap;
+    }
+    int k = s->nframes++;
+    s->starts[k + 1] = s->starts[k] + raw;
+    s->packed_at[k + 1] = s->packed_at[k] + LZ61_HEADER + plen;
+    return true;
+}
+
+/* This function moves `s->under` to position `pos` if it isn't there.
+ */
+static bool lz_move(lz61_stream* s, off_t pos) {
+    if (s->at != pos) {
+        if (io61_seek(s->under, pos) < 0) {
+            return false;
+        }
+        s->at = pos;
+    }
+    return true;
+}
+
+/* This function reads frame `k` (at most nframes, so where it starts is
+ * known) into `s->frame`. Returns its length, 0 if the stream ends
+ * there, or -1 on error.
+ */
+static ssize_t lz_load(lz61_stream* s, int k) {
+    size_t raw, plen;
+    bool stored;
+    int r = -1;
+    if (lz_move(s, s->packed_at[k])) {
+        r = lz_read_header(s, &raw, &plen, &stored);
+    }
+    if (r <= 0) {
+        s->error = s->error || r < 0;
+        return r;
+    }
+    unsigned char* dst = stored ? s->frame : s->packed;
+    if (io61_read(s->under, (char*) dst, plen) != (ssize_t) plen
+        || (!stored && lz_decompress(s->packed, plen, s->frame, LZ61_FRAME) != (ssize_t) raw)
+        || (k == s->nframes && !lz_add_frame(s, raw, plen))) {
+        s->error = true;
+        s->cur = -1;
+        s->at = -1;
+        return -1;
+    }
+    s->at += plen;
+    s->cur = k;
+    s->start = s->starts[k];
+    s->len = raw;
+    return raw;
+}
+
+
+// lz61_open(under, mode)
+//    Return a new stream that reads compressed frames from `under` (if
+//    `mode` is O_RDONLY) or writes them to it (O_WRONLY). Seeking needs
+//    the stream to start at the beginning of a seekable `under`. Returns
+//    NULL for other modes or if out of memory.
+
+lz61_stream* lz61_open(io61_file* under, int mode) {
+    if (mode != O_RDONLY && mode != O_WRONLY) {
+        return NULL;
+    }
+    lz61_stream* s = (lz61_stream*) calloc(1, sizeof(lz61_stream));
+    if (!s) {
+        return NULL;
+    }
+    s->under = under;
+    s->mode = mode;
+    s->cur = -1;
+    s->frames_cap = 16;
+    s->frame = (unsigned char*) malloc(LZ61_FRAME);
+    s->packed = (unsigned char*) malloc(LZ61_PACKED_MAX);
+    if (mode == O_RDONLY) {
+        s->starts = (off_t*) calloc(s->frames_cap, sizeof(off_t));
+        s->packed_at = (off_t*) calloc(s->frames_cap, sizeof(off_t));
+    } else {
+        s->matcher = (lz61_matcher*) malloc(sizeof(lz61_matcher));
+    }
+    if (!s->frame || !s->packed
+        || (mode == O_RDONLY ? !s->starts || !s->packed_at : !s->matcher)) {
+        s->under = NULL;
+        lz61_close(s);
+        return NULL;
+    }
+    return s;
+}
+
+
+// lz61_close(s)
+//    Free stream `s` and close the file under it. Data a writer hasn't
+//    handed to lz61_put is lost.
+
+int lz61_close(lz61_stream* s) {
+    int r = s->under ? io61_close(s->under) : 0;
+    free(s->frame);
+    free(s->packed);
+    free(s->matcher);
+    free(s->starts);
+    free(s->packed_at);
+    free(s);
+    return r;
+}
+
+
+// lz61_next(s)
+//    Read the frame after the current one into `s->frame`. Returns its
+//    length, 0 at the end of the stream, or -1 on error.
+
+ssize_t lz61_next(lz61_stream* s) {
+    if (s->mode != O_RDONLY || s->error) {
+        return -1;
+    }
+    return lz_load(s, s->cur + 1);
+}
+
+
+// lz61_seek(s, pos)
+//    Make the frame holding byte `pos` of the data current, or the last
+//    frame if `pos` is the end of the data. Frame headers that haven't
+//    been seen yet are read, and their data skipped, until `pos` is
+//    found. Nothing changes if `pos` is in the current frame or at its
+//    end, or is 0 before any frame has been read (so streams that can't
+//    seek can still seek there). Returns 0 on success and -1 if `pos` is
+//    past the end or on error.
+
+int lz61_seek(lz61_stream* s, off_t pos) {
+    if (s->mode != O_RDONLY || s->error || pos < 0) {
+        return -1;
+    } else if (s->cur >= 0 ? pos >= s->start && pos <= s->start + (off_t) s->len
+               : pos == 0 && s->at == 0) {
+        return 0;
+    }
+    while (pos >= s->starts[s->nframes]) {
+        size_t raw, plen;
+        bool stored;
+        int r = -1;
+        if (lz_move(s, s->packed_at[s->nframes])) {
+            r = lz_read_header(s, &raw, &plen, &stored);
+        }
+        if (r == 0) {
+            break;
+        } else if (r < 0 || !lz_add_frame(s, raw, plen)) {
+            s->error = true;
+            return -1;
+        }
+    }
+    if (pos > s->starts[s->nframes]) {
+        return -1;
+    } else if (s->nframes == 0) {
+        s->start = s->len = 0;
+        return 0;
+    }
+    // binary search for the last frame starting at or before pos
+    int lo = 0;
+    int hi = s->nframes - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (s->starts[mid] <= pos) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    if (lo != s->cur && lz_load(s, lo) <= 0) {
+        return -1;
+    }
+    return 0;
+}
+
+
+// lz61_put(s, data, n)
+//    Write the `n` bytes at `data` (at most LZ61_FRAME) to `s` as one
+//    frame. Returns 0 on success and -1 on error.
+
+int lz61_put(lz61_stream* s, const unsigned char* data, size_t n) {
+    if (s->mode != O_WRONLY || n == 0 || n > LZ61_FRAME) {
+        return n == 0 ? 0 : -1;
+    }
+    size_t plen = lz_compress(s->matcher, data, n, s->packed);
+    const unsigned char* payload = s->packed;
+    uint32_t flags = 0;
+    if (plen >= n) {
+        payload = data;
+        plen = n;
+        flags = LZ61_STORED;
+    }
+    unsigned char h[LZ61_HEADER];
+    lz_put32(h, n);
+    lz_put32(&h[4], plen | flags);
+    if (io61_write(s->under, (const char*) h, LZ61_HEADER) != LZ61_HEADER
+        || io61_write(s->under, (const char*) payload, plen) != (ssize_t) plen) {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+#ifndef LZ61_H
+#define LZ61_H
+#include "io61.h"
+#include <stdbool.h>
+
+// lz61.h
+//    The IO61_LZ filter's stream of compressed frames, which every io61
+//    version shares so they all write the same bytes.
+//
+//    A stream is a sequence of frames, each holding up to LZ61_FRAME bytes
+//    of data and compressed on its own, so reading can start at any frame.
+//    A frame is an 8-byte header (the data length, then the length of
+//    what follows, as little-endian 32-bit numbers; the top bit of the
+//    second is set if the data is stored uncompressed because compressing
+//    didn't help) and the compressed data. Writers emit a frame whenever
+//    they have LZ61_FRAME bytes, and when flushed or closed.
+//
+//    The compressed data is LZ77 in the style of LZ4: a sequence of
+//    literal runs, each followed by a match that copies earlier data of
+//    the frame. A token byte holds the literal count (high 4 bits) and the
+//    match length minus 4 (low 4 bits); 15 in either means more length
+//    bytes follow (255 meaning "add 255 and keep going"). The literals
+//    come after the literal count and then, unless the frame ends there,
+//    the match: its distance back (2 bytes, little-endian) and any extra
+//    length bytes.
+
+#define LZ61_FRAME 65536
+#define LZ61_HEADER 8
+
+typedef struct lz61_matcher lz61_matcher;
+
+// lz61_stream
+//    One end of a compressed stream, read from or written to `under`.
+//    Readers decode one frame at a time into `frame`: `len` bytes that
+//    start `start` bytes into the data. Writers compress the frames they
+//    are handed (io61 versions buffer them in `frame` or their own
+//    buffer). A reader knows where frames 0 to nframes - 1 start, both in
+//    the data (`starts`) and in `under` (`packed_at`); entry nframes is
+//    where the frames it hasn't seen yet begin. `cur` is the frame in
+//    `frame` (-1 for none) and `at` is the position of `under`.
+
+typedef struct lz61_stream {
+    io61_file* under;
+    int mode;
+    unsigned char* frame;
+    size_t len;
+    off_t start;
+    unsigned char* packed;
+    lz61_matcher* matcher;
+    off_t* starts;
+    off_t* packed_at;
+    int nframes;
+    int frames_cap;
+    int cur;
+    off_t at;
+    bool error;
+} lz61_stream;
+
+lz61_stream* lz61_open(io61_file* under, int mode);
+int lz61_close(lz61_stream* s);
+
+ssize_t lz61_next(lz61_stream* s);
+int lz61_seek(lz61_stream* s, off_t pos);
+int lz61_put(lz61_stream* s, const unsigned char* data, size_t n);
+
+#endif
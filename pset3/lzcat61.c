@@ -0,0 +1,51 @@
+#include "io61.h"
+
+// Usage: ./lzcat61 [-d] [-o OFFSET] [FILE]
+//    Compresses the input FILE to standard output through the IO61_LZ
+//    filter. With -d, FILE is compressed data and is decompressed instead;
+//    -o OFFSET then starts the output OFFSET bytes into the decompressed
+//    data, which seeks in FILE.
+
+int main(int argc, char** argv) {
+    // Parse arguments
+    int decompress = 0;
+    off_t offset = 0;
+    while (argc >= 2) {
+        if (strcmp(argv[1], "-d") == 0) {
+            decompress = 1;
+            --argc, ++argv;
+        } else if (argc >= 3 && strcmp(argv[1], "-o") == 0) {
+            offset = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else
+            break;
+    }
+
+    // Open files
+    const char* in_filename = argc >= 2 ? argv[1] : NULL;
+    io61_profile_begin();
+    io61_file* inf = io61_open_check(in_filename, O_RDONLY);
+    io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+    if (decompress)
+        inf = io61_open_filter(inf, IO61_LZ);
+    else
+        outf = io61_open_filter(outf, IO61_LZ);
+    assert(inf && outf);
+    if (offset != 0 && io61_seek(inf, offset) < 0) {
+        fprintf(stderr, "lzcat61: can't seek to %ld\n", (long) offset);
+        exit(1);
+    }
+
+    // Copy file data
+    char buf[4096];
+    while (1) {
+        ssize_t amount = io61_read(inf, buf, sizeof(buf));
+        if (amount <= 0)
+            break;
+        io61_write(outf, buf, amount);
+    }
+
+    io61_close(inf);
+    io61_close(outf);
+    io61_profile_end();
+}
@@ -0,0 +1,96 @@
+#include "io61.h"
+
+// Usage: ./patch61 [-b BLOCKSIZE] [-t STRIDE] [-r RANDOMSEED] FILE
+//    Updates FILE in place, then copies it to standard output. Every
+//    STRIDE bytes, a record of BLOCKSIZE bytes is read, the case of its
+//    letters is swapped, and it is written back over itself; with -r the
+//    records are patched in random order. A line counting the records
+//    is appended to FILE. Finally FILE is read from the beginning through
+//    the same io61_file, so the output shows what reads see of the
+//    buffered writes. Default BLOCKSIZE is 64 and default STRIDE is 4096.
+
+int main(int argc, char** argv) {
+    // Parse arguments
+    size_t blocksize = 64;
+    size_t stride = 4096;
+    int shuffle = 0;
+    while (argc >= 3) {
+        if (strcmp(argv[1], "-b") == 0) {
+            blocksize = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-t") == 0) {
+            stride = strtoul(argv[2], 0, 0);
+            argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-r") == 0) {
+            srandom(strtoul(argv[2], 0, 0));
+            shuffle = 1;
+            argc -= 2, argv += 2;
+        } else
+            break;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "Usage: patch61 [-b BLOCKSIZE] [-t STRIDE] [-r RANDOMSEED] FILE\n");
+        exit(1);
+    }
+
+    // Allocate buffer, open files, measure file sizes
+    assert(blocksize > 0 && stride > 0);
+    char* buf = (char*) malloc(blocksize > 4096 ? blocksize : 4096);
+
+    io61_profile_begin();
+    io61_file* f = io61_open_check(argv[1], O_RDWR);
+    ssize_t f_size = io61_filesize(f);
+    if (f_size < 0) {
+        fprintf(stderr, "patch61: can't get size of file\n");
+        exit(1);
+    }
+    io61_file* outf = io61_fdopen(STDOUT_FILENO, O_WRONLY);
+
+    // Calculate the order records are patched in
+    size_t nrecords = (f_size + stride - 1) / stride;
+    size_t* order = (size_t*) malloc(sizeof(size_t) * (nrecords ? nrecords : 1));
+    for (size_t i = 0; i < nrecords; ++i)
+        order[i] = i;
+    for (size_t i = 0; shuffle && i + 1 < nrecords; ++i) {
+        size_t j = i + random() % (nrecords - i);
+        size_t tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    // Patch records in place
+    for (size_t i = 0; i < nrecords; ++i) {
+        off_t pos = (off_t) order[i] * stride;
+        int r = io61_seek(f, pos);
+        assert(r >= 0);
+        ssize_t amount = io61_read(f, buf, blocksize);
+        if (amount <= 0)
+            continue;
+        for (ssize_t j = 0; j < amount; ++j)
+            if ((buf[j] >= 'a' && buf[j] <= 'z') || (buf[j] >= 'A' && buf[j] <= 'Z'))
+                buf[j] ^= 0x20;
+        r = io61_seek(f, pos);
+        assert(r >= 0);
+        io61_write(f, buf, amount);
+    }
+
+    // Append a trailer
+    int n = snprintf(buf, 4096, "patch61: %zu records\n", nrecords);
+    io61_seek(f, f_size);
+    io61_write(f, buf, n);
+
+    // Copy the patched file to standard output
+    io61_seek(f, 0);
+    while (1) {
+        ssize_t amount = io61_read(f, buf, 4096);
+        if (amount <= 0)
+            break;
+        io61_write(outf, buf, amount);
+    }
+
+    io61_close(f);
+    io61_close(outf);
+    io61_profile_end();
+    free(order);
+    free(buf);
+}
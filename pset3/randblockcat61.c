@@ -1,20 +1,25 @@
 #include "io61.h"
 
-// Usage: ./randblockcat61 [-b MAXBLOCKSIZE] [-r RANDOMSEED] [FILE]
+// Usage: ./randblockcat61 [-b MAXBLOCKSIZE] [-r RANDOMSEED] [-k] [FILE]
 //    Copies the input FILE to standard output in blocks. Each block has a
 //    random size between 1 and MAXBLOCKSIZE (which defaults to 4096).
+//    With -k, each block is copied with io61_copy.
 
 int main(int argc, char** argv) {
     // Parse arguments
     size_t max_blocksize = 4096;
+    int use_copy = 0;
     srandom(83419);
-    while (argc >= 3) {
-        if (strcmp(argv[1], "-b") == 0) {
+    while (argc >= 2) {
+        if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
             max_blocksize = strtoul(argv[2], 0, 0);
             argc -= 2, argv += 2;
-        } else if (strcmp(argv[1], "-r") == 0) {
+        } else if (argc >= 3 && strcmp(argv[1], "-r") == 0) {
             srandom(strtoul(argv[2], 0, 0));
             argc -= 2, argv += 2;
+        } else if (strcmp(argv[1], "-k") == 0) {
+            use_copy = 1;
+            --argc, ++argv;
         } else
             break;
     }
@@ -31,10 +36,16 @@ int main(int argc, char** argv) {
     // Copy file data
     while (1) {
         size_t m = (random() % max_blocksize) + 1;
-        ssize_t amount = io61_read(inf, buf, m);
+        ssize_t amount;
+        if (use_copy)
+            amount = io61_copy(inf, outf, m);
+        else {
+            amount = io61_read(inf, buf, m);
+            if (amount > 0)
+                io61_write(outf, buf, amount);
+        }
         if (amount <= 0)
             break;
-        io61_write(outf, buf, amount);
     }
 
     io61_close(inf);
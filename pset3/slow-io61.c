@@ -1,4 +1,6 @@
 #include "io61.h"
+#include "lz61.h"
+#include "crc61.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
@@ -12,47 +14,102 @@
 //    Data structure for io61 file wrappers.
 
 struct io61_file {
+    io61_buffer buf;    // always empty, so every character is out of line
     int fd;
+    char* line;
+    size_t line_cap;
+    int mode;
+    // Filtered files: their stream, and the position in its frame
+    struct lz61_stream* lz;
+    size_t lz_pos;
+    // CRC32C of the data read or written, if `checksum` is set
+    int checksum;
+    uint32_t crc;
+    // Bytes lent by io61_borrow: [lend_pos, lend_len) are still unread
+    char* lend;
+    size_t lend_pos;
+    size_t lend_len;
 };
 
 
 // io61_fdopen(fd, mode)
 //    Return a new io61_file that reads from and/or writes to the given
-//    file descriptor `fd`. `mode` is either O_RDONLY for a read-only file
-//    or O_WRONLY for a write-only file. You need not support read/write
-//    files.
+//    file descriptor `fd`. `mode` is O_RDONLY for a read-only file,
+//    O_WRONLY for a write-only file, or O_RDWR for a file that is both.
 
 io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
-    io61_file* f = (io61_file*) malloc(sizeof(io61_file));
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
     f->fd = fd;
-    (void) mode;
+    f->mode = mode;
     return f;
 }
 
 
+// io61_open_filter(f, filter)
+//    Return a new io61_file that passes what is read from or written to
+//    it through `filter`, reading from or writing to `f`, which it takes
+//    over. Returns NULL if `filter` is unknown or `f` was opened O_RDWR.
+
+io61_file* io61_open_filter(io61_file* f, int filter) {
+    if (filter != IO61_LZ) {
+        return NULL;
+    }
+    lz61_stream* lz = lz61_open(f, f->mode);
+    if (!lz) {
+        return NULL;
+    }
+    io61_file* ff = (io61_file*) calloc(1, sizeof(io61_file));
+    ff->fd = -1;
+    ff->mode = f->mode;
+    ff->lz = lz;
+    return ff;
+}
+
+
 // io61_close(f)
 //    Close the io61_file `f` and release all its resources, including
 //    any buffers.
 
 int io61_close(io61_file* f) {
     io61_flush(f);
-    int r = close(f->fd);
+    int r = f->lz ? lz61_close(f->lz) : close(f->fd);
+    free(f->line);
+    free(f->lend);
     free(f);
     return r;
 }
 
 
-// io61_readc(f)
+// io61_setbuf(f, size, nslots)
+//    This version doesn't buffer, so there is nothing to size.
+
+int io61_setbuf(io61_file* f, size_t size, int nslots) {
+    (void) f, (void) size, (void) nslots;
+    return 0;
+}
+
+
+// io61_readc_slow(f)
 //    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+//    (which is -1) on error or end-of-file. io61_readc calls this.
 
-int io61_readc(io61_file* f) {
+int io61_readc_slow(io61_file* f) {
     unsigned char buf[1];
-    if (read(f->fd, buf, 1) == 1)
-        return buf[0];
-    else
+    if (f->lend_pos != f->lend_len) {
+        buf[0] = f->lend[f->lend_pos++];
+    } else if (f->lz) {
+        if (f->lz_pos == f->lz->len) {
+            if (lz61_next(f->lz) <= 0)
+                return EOF;
+            f->lz_pos = 0;
+        }
+        buf[0] = f->lz->frame[f->lz_pos++];
+    } else if (read(f->fd, buf, 1) != 1)
         return EOF;
+    if (f->checksum)
+        f->crc = crc61(f->crc, buf, 1);
+    return buf[0];
 }
 
 
@@ -78,11 +135,106 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
-// io61_writec(f)
+// io61_borrow(f, ptr, maxsz)
+//    Set `*ptr` to the next unread bytes of `f` and return how many there
+//    are, at most `maxsz`. Returns 0 at end of file. The bytes stay unread
+//    until io61_release. This version has no buffer to lend from, so it
+//    reads them into one of its own; `*ptr` is only valid until the next
+//    read.
+
+ssize_t io61_borrow(io61_file* f, const char** ptr, size_t maxsz) {
+    if (f->lend_pos == f->lend_len) {
+        if (!f->lend && !(f->lend = (char*) malloc(BUFSIZ)))
+            return -1;
+        // The checksum takes the bytes as they are released
+        int checksum = f->checksum;
+        f->checksum = 0;
+        ssize_t n = io61_read(f, f->lend, maxsz < BUFSIZ ? maxsz : BUFSIZ);
+        f->checksum = checksum;
+        f->lend_pos = 0;
+        f->lend_len = n > 0 ? n : 0;
+        if (n <= 0) {
+            *ptr = NULL;
+            return n;
+        }
+    }
+    *ptr = &f->lend[f->lend_pos];
+    size_t avail = f->lend_len - f->lend_pos;
+    return avail < maxsz ? avail : maxsz;
+}
+
+
+// io61_release(f, n)
+//    Mark `n` bytes returned by the last io61_borrow as read. Returns 0 on
+//    success and -1 if `n` is more than was borrowed.
+
+int io61_release(io61_file* f, size_t n) {
+    if (n > f->lend_len - f->lend_pos)
+        return -1;
+    if (f->checksum)
+        f->crc = crc61(f->crc, &f->lend[f->lend_pos], n);
+    f->lend_pos += n;
+    return 0;
+}
+
+
+// io61_readline(f, line, len)
+//    Read the next line of `f`, up to and including its newline. Sets
+//    `*line` and `*len` to it and returns its length, or 0 at end of file.
+//    `*line` is only valid until the next read. This version reads one
+//    character at a time.
+
+ssize_t io61_readline(io61_file* f, const char** line, size_t* len) {
+    size_t n = 0;
+    int ch;
+    while ((ch = io61_readc(f)) != EOF) {
+        if (n == f->line_cap) {
+            f->line_cap = f->line_cap ? f->line_cap * 2 : 128;
+            f->line = (char*) realloc(f->line, f->line_cap);
+        }
+        f->line[n++] = ch;
+        if (ch == '\n')
+            break;
+    }
+    *line = n ? f->line : NULL;
+    *len = n;
+    return n;
+}
+
+
+// io61_scan_until(f, delim)
+//    Skip over the data of `f` up to and including the next `delim` byte.
+//    Returns the number of bytes skipped, which is 0 at end of file.
+
+ssize_t io61_scan_until(io61_file* f, int delim) {
+    ssize_t n = 0;
+    int ch;
+    while ((ch = io61_readc(f)) != EOF) {
+        ++n;
+        if (ch == (unsigned char) delim)
+            break;
+    }
+    return n;
+}
+
+
+// io61_writec_slow(f, ch)
 //    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+//    -1 on error. io61_writec calls this.
 
-int io61_writec(io61_file* f, int ch) {
+int io61_writec_slow(io61_file* f, int ch) {
+    if (f->checksum) {
+        unsigned char c = ch;
+        f->crc = crc61(f->crc, &c, 1);
+    }
+    if (f->lz) {
+        f->lz->frame[f->lz_pos++] = ch;
+        if (f->lz_pos == LZ61_FRAME) {
+            f->lz_pos = 0;
+            return lz61_put(f->lz, f->lz->frame, LZ61_FRAME);
+        }
+        return 0;
+    }
     unsigned char buf[1];
     buf[0] = ch;
     if (write(f->fd, buf, 1) == 1)
@@ -111,22 +263,75 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_copy(inf, outf, n)
+//    Copy up to `n` bytes from `inf` to `outf`, stopping early at end of
+//    file. Returns the number of bytes copied, or -1 if an error occurred
+//    before any were. This version copies one character at a time.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t n) {
+    size_t ncopied = 0;
+    int ch = 0;
+    while (ncopied != n) {
+        ch = io61_readc(inf);
+        if (ch == EOF || io61_writec(outf, ch) == -1)
+            break;
+        ++ncopied;
+    }
+    if (ncopied != 0 || n == 0 || (ch == EOF && io61_eof(inf)))
+        return ncopied;
+    else
+        return -1;
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
 //    data buffered for reading, or do nothing.
 
 int io61_flush(io61_file* f) {
-    (void) f;
+    // Filtered files compress their partial frame
+    if (f->lz && f->mode == O_WRONLY) {
+        int r = lz61_put(f->lz, f->lz->frame, f->lz_pos);
+        f->lz_pos = 0;
+        return io61_flush(f->lz->under) < 0 ? -1 : r;
+    }
     return 0;
 }
 
 
+// io61_setchecksum(f, enable)
+//    Start keeping a CRC32C of the data read from or written to `f` from
+//    now on (if `enable` is nonzero), or stop. Returns 0.
+
+int io61_setchecksum(io61_file* f, int enable) {
+    f->checksum = enable;
+    f->crc = 0;
+    return 0;
+}
+
+
+// io61_checksum(f)
+//    Return the CRC32C of the data read from or written to `f` since
+//    io61_setchecksum. This version adds each character as it goes.
+
+uint32_t io61_checksum(io61_file* f) {
+    return f->crc;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
+    f->lend_pos = f->lend_len = 0;
+    if (f->lz) {
+        if (lz61_seek(f->lz, pos) < 0)
+            return -1;
+        f->lz_pos = pos - f->lz->start;
+        return 0;
+    }
     off_t r = lseek(f->fd, (off_t) pos, SEEK_SET);
     if (r == (off_t) pos)
         return 0;
@@ -178,6 +383,8 @@ off_t io61_filesize(io61_file* f) {
 //    immediately after a `read` call that returned 0 or -1.
 
 int io61_eof(io61_file* f) {
+    if (f->lz)
+        return !f->lz->error;
     char x;
     ssize_t nread = read(f->fd, &x, 1);
     if (nread == 1) {
@@ -187,3 +394,15 @@ int io61_eof(io61_file* f) {
     }
     return nread == 0;
 }
+
+
+// io61_profile_stats(buf, size)
+//    Write io61's counters to `buf` as JSON members. This version keeps
+//    none, so the report is empty.
+
+int io61_profile_stats(char* buf, size_t size) {
+    if (size > 0) {
+        buf[0] = '\0';
+    }
+    return 0;
+}
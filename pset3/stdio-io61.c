@@ -1,4 +1,7 @@
+#define _GNU_SOURCE
 #include "io61.h"
+#include "lz61.h"
+#include "crc61.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <limits.h>
@@ -12,24 +15,146 @@
 //    Data structure for io61 file wrappers.
 
 struct io61_file {
+    io61_buffer buf;    // always empty, so every character is out of line
     FILE* f;
+    char* line;
+    size_t line_cap;
+    int mode;
+    // Filtered files: the stream under `f`, and the position in its frame
+    struct lz61_stream* lz;
+    size_t lz_pos;
+    // CRC32C of the data read or written, if `checksum` is set
+    int checksum;
+    uint32_t crc;
+    // Bytes lent by io61_borrow: [lend_pos, lend_len) are still unread
+    char* lend;
+    size_t lend_pos;
+    size_t lend_len;
 };
 
 
+/* This function adds the `n` bytes at `p` to `f`'s checksum, if it keeps
+ * one.
+ */
+static void crc_add(io61_file* f, const void* p, size_t n) {
+    if (f->checksum)
+        f->crc = crc61(f->crc, p, n);
+}
+
+/* This function reads up to `sz` of the bytes io61_borrow lent and that
+ * weren't released into `buf`. Every read takes these before stdio's.
+ */
+static size_t lend_take(io61_file* f, char* buf, size_t sz) {
+    size_t n = f->lend_len - f->lend_pos;
+    n = n < sz ? n : sz;
+    if (n != 0) {
+        memcpy(buf, &f->lend[f->lend_pos], n);
+        crc_add(f, buf, n);
+        f->lend_pos += n;
+    }
+    return n;
+}
+
+
 // io61_fdopen(fd, mode)
 //    Return a new io61_file that reads from and/or writes to the given
-//    file descriptor `fd`. `mode` is either O_RDONLY for a read-only file
-//    or O_WRONLY for a write-only file. You need not support read/write
-//    files.
+//    file descriptor `fd`. `mode` is O_RDONLY for a read-only file,
+//    O_WRONLY for a write-only file, or O_RDWR for a file that is both.
 
 io61_file* io61_fdopen(int fd, int mode) {
     assert(fd >= 0);
-    io61_file* f = (io61_file*) malloc(sizeof(io61_file));
-    f->f = fdopen(fd, mode == O_RDONLY ? "r" : "w");
+    io61_file* f = (io61_file*) calloc(1, sizeof(io61_file));
+    f->f = fdopen(fd, mode == O_RDONLY ? "r" : mode == O_RDWR ? "r+" : "w");
+    f->mode = mode;
     return f;
 }
 
 
+/* These functions are the stdio cookie functions of filtered files,
+ * which stdio buffers like any other. Reads decompress a frame at a time
+ * and writes fill a frame before compressing it.
+ */
+static ssize_t lz_cookie_read(void* cookie, char* buf, size_t size) {
+    io61_file* f = (io61_file*) cookie;
+    if (f->lz_pos == f->lz->len) {
+        ssize_t r = lz61_next(f->lz);
+        if (r <= 0) {
+            return r;
+        }
+        f->lz_pos = 0;
+    }
+    size_t n = f->lz->len - f->lz_pos;
+    n = n < size ? n : size;
+    memcpy(buf, &f->lz->frame[f->lz_pos], n);
+    f->lz_pos += n;
+    return n;
+}
+
+static ssize_t lz_cookie_write(void* cookie, const char* buf, size_t size) {
+    io61_file* f = (io61_file*) cookie;
+    size_t done = 0;
+    while (done != size) {
+        size_t n = LZ61_FRAME - f->lz_pos;
+        n = n < size - done ? n : size - done;
+        memcpy(&f->lz->frame[f->lz_pos], &buf[done], n);
+        f->lz_pos += n;
+        done += n;
+        if (f->lz_pos == LZ61_FRAME) {
+            f->lz_pos = 0;
+            if (lz61_put(f->lz, f->lz->frame, LZ61_FRAME) < 0) {
+                return -1;
+            }
+        }
+    }
+    return done;
+}
+
+static int lz_cookie_seek(void* cookie, off64_t* pos, int whence) {
+    io61_file* f = (io61_file*) cookie;
+    off64_t to = *pos;
+    if (whence == SEEK_CUR) {
+        to += f->lz->start + f->lz_pos;
+    } else if (whence != SEEK_SET) {
+        return -1;
+    }
+    if (lz61_seek(f->lz, to) < 0) {
+        return -1;
+    }
+    f->lz_pos = to - f->lz->start;
+    *pos = to;
+    return 0;
+}
+
+static int lz_cookie_close(void* cookie) {
+    (void) cookie;
+    return 0;
+}
+
+
+// io61_open_filter(f, filter)
+//    Return a new io61_file that passes what is read from or written to
+//    it through `filter`, reading from or writing to `f`, which it takes
+//    over. Returns NULL if `filter` is unknown or `f` was opened O_RDWR.
+
+io61_file* io61_open_filter(io61_file* f, int filter) {
+    if (filter != IO61_LZ || f->mode == O_RDWR) {
+        return NULL;
+    }
+    io61_file* ff = (io61_file*) calloc(1, sizeof(io61_file));
+    ff->mode = f->mode;
+    ff->lz = lz61_open(f, f->mode);
+    if (!ff->lz) {
+        free(ff);
+        return NULL;
+    }
+    cookie_io_functions_t io = {
+        lz_cookie_read, lz_cookie_write, lz_cookie_seek, lz_cookie_close
+    };
+    ff->f = fopencookie(ff, f->mode == O_RDONLY ? "r" : "w", io);
+    return ff;
+}
+
+
 // io61_close(f)
 //    Close the io61_file `f` and release all its resources, including
 //    any buffers.
@@ -37,17 +162,44 @@ io61_file* io61_fdopen(int fd, int mode) {
 int io61_close(io61_file* f) {
     io61_flush(f);
     int r = fclose(f->f);
+    if (f->lz) {
+        r = lz61_close(f->lz) < 0 ? -1 : r;
+    }
+    free(f->line);
+    free(f->lend);
     free(f);
     return r;
 }
 
 
-// io61_readc(f)
-//    Read a single (unsigned) character from `f` and return it. Returns EOF
-//    (which is -1) on error or end-of-file.
+// io61_setbuf(f, size, nslots)
+//    Use a buffer of `size` bytes for `f` (0 keeps the default). stdio
+//    has a single buffer per file, so `nslots` is ignored. Must be called
+//    before `f` is read or written.
+
+int io61_setbuf(io61_file* f, size_t size, int nslots) {
+    (void) nslots;
+    if (size == 0) {
+        return 0;
+    }
+    return setvbuf(f->f, NULL, _IOFBF, size) == 0 ? 0 : -1;
+}
+
 
-int io61_readc(io61_file* f) {
-    return fgetc(f->f);
+// io61_readc_slow(f)
+//    Read a single (unsigned) character from `f` and return it. Returns EOF
+//    (which is -1) on error or end-of-file. io61_readc calls this.
+
+int io61_readc_slow(io61_file* f) {
+    unsigned char c;
+    if (lend_take(f, (char*) &c, 1))
+        return c;
+    int ch = fgetc(f->f);
+    if (ch != EOF) {
+        c = ch;
+        crc_add(f, &c, 1);
+    }
+    return ch;
 }
 
 
@@ -58,7 +210,10 @@ int io61_readc(io61_file* f) {
 //    -1 an error occurred before any characters were read.
 
 ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
-    size_t n = fread(buf, 1, sz, f->f);
+    size_t lent = lend_take(f, buf, sz);
+    size_t n = fread(&buf[lent], 1, sz - lent, f->f);
+    crc_add(f, &buf[lent], n);
+    n += lent;
     if (n != 0 || sz == 0 || !ferror(f->f))
         return (ssize_t) n;
     else
@@ -66,11 +221,107 @@ ssize_t io61_read(io61_file* f, char* buf, size_t sz) {
 }
 
 
-// io61_writec(f)
+// io61_borrow(f, ptr, maxsz)
+//    Set `*ptr` to the next unread bytes of `f` and return how many there
+//    are, at most `maxsz`. Returns 0 at end of file. The bytes stay unread
+//    until io61_release. stdio doesn't lend its buffer, so this version
+//    reads them into one of its own; `*ptr` is only valid until the next
+//    read.
+
+ssize_t io61_borrow(io61_file* f, const char** ptr, size_t maxsz) {
+    if (f->lend_pos == f->lend_len) {
+        if (!f->lend && !(f->lend = (char*) malloc(BUFSIZ)))
+            return -1;
+        // The checksum takes the bytes as they are released
+        int checksum = f->checksum;
+        f->checksum = 0;
+        ssize_t n = io61_read(f, f->lend, maxsz < BUFSIZ ? maxsz : BUFSIZ);
+        f->checksum = checksum;
+        f->lend_pos = 0;
+        f->lend_len = n > 0 ? n : 0;
+        if (n <= 0) {
+            *ptr = NULL;
+            return n;
+        }
+    }
+    *ptr = &f->lend[f->lend_pos];
+    size_t avail = f->lend_len - f->lend_pos;
+    return avail < maxsz ? avail : maxsz;
+}
+
+
+// io61_release(f, n)
+//    Mark `n` bytes returned by the last io61_borrow as read. Returns 0 on
+//    success and -1 if `n` is more than was borrowed.
+
+int io61_release(io61_file* f, size_t n) {
+    if (n > f->lend_len - f->lend_pos)
+        return -1;
+    crc_add(f, &f->lend[f->lend_pos], n);
+    f->lend_pos += n;
+    return 0;
+}
+
+
+// io61_readline(f, line, len)
+//    Read the next line of `f`, up to and including its newline. Sets
+//    `*line` and `*len` to it and returns its length, or 0 at end of file.
+//    `*line` is only valid until the next read.
+
+ssize_t io61_readline(io61_file* f, const char** line, size_t* len) {
+    // A line starting in borrowed bytes is read a character at a time
+    if (f->lend_pos != f->lend_len) {
+        size_t n = 0;
+        int ch;
+        while ((ch = io61_readc_slow(f)) != EOF) {
+            if (n == f->line_cap) {
+                f->line_cap = f->line_cap ? f->line_cap * 2 : 128;
+                f->line = (char*) realloc(f->line, f->line_cap);
+            }
+            f->line[n++] = ch;
+            if (ch == '\n')
+                break;
+        }
+        *line = f->line;
+        *len = n;
+        return n;
+    }
+    ssize_t n = getline(&f->line, &f->line_cap, f->f);
+    if (n <= 0) {
+        *line = NULL;
+        *len = 0;
+        return ferror(f->f) ? -1 : 0;
+    }
+    *line = f->line;
+    *len = n;
+    crc_add(f, f->line, n);
+    return n;
+}
+
+
+// io61_scan_until(f, delim)
+//    Skip over the data of `f` up to and including the next `delim` byte.
+//    Returns the number of bytes skipped, which is 0 at end of file.
+
+ssize_t io61_scan_until(io61_file* f, int delim) {
+    ssize_t n = 0;
+    int ch;
+    while ((ch = io61_readc_slow(f)) != EOF) {
+        ++n;
+        if (ch == (unsigned char) delim)
+            break;
+    }
+    return n;
+}
+
+
+// io61_writec_slow(f, ch)
 //    Write a single character `ch` to `f`. Returns 0 on success or
-//    -1 on error.
+//    -1 on error. io61_writec calls this.
 
-int io61_writec(io61_file* f, int ch) {
+int io61_writec_slow(io61_file* f, int ch) {
+    unsigned char c = ch;
+    crc_add(f, &c, 1);
     return fputc(ch, f->f);
 }
 
@@ -82,6 +333,7 @@ int io61_writec(io61_file* f, int ch) {
 
 ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
     size_t n = fwrite(buf, 1, sz, f->f);
+    crc_add(f, buf, n);
     if (n != 0 || sz == 0 || !ferror(f->f))
         return (ssize_t) n;
     else
@@ -89,23 +341,84 @@ ssize_t io61_write(io61_file* f, const char* buf, size_t sz) {
 }
 
 
+// io61_copy(inf, outf, n)
+//    Copy up to `n` bytes from `inf` to `outf`, stopping early at end of
+//    file. Returns the number of bytes copied, or -1 if an error occurred
+//    before any were. stdio has no kernel-side copy, so this goes through
+//    a buffer.
+
+ssize_t io61_copy(io61_file* inf, io61_file* outf, size_t n) {
+    char buf[BUFSIZ];
+    size_t ncopied = 0;
+    while (ncopied != n) {
+        size_t want = n - ncopied < sizeof(buf) ? n - ncopied : sizeof(buf);
+        size_t nr = lend_take(inf, buf, want);
+        if (nr == 0) {
+            nr = fread(buf, 1, want, inf->f);
+            crc_add(inf, buf, nr);
+        }
+        if (nr == 0)
+            break;
+        size_t nw = fwrite(buf, 1, nr, outf->f);
+        crc_add(outf, buf, nw);
+        ncopied += nw;
+        if (nw != nr)
+            break;
+    }
+    if (ncopied != 0 || n == 0 || (!ferror(inf->f) && !ferror(outf->f)))
+        return (ssize_t) ncopied;
+    else
+        return (ssize_t) -1;
+}
+
+
 // io61_flush(f)
 //    Forces a write of all buffered data written to `f`.
 //    If `f` was opened read-only, io61_flush(f) may either drop all
 //    data buffered for reading, or do nothing.
 
 int io61_flush(io61_file* f) {
-    return fflush(f->f);
-    (void) f;
+    int r = fflush(f->f);
+    // Filtered files also compress their partial frame
+    if (f->lz && f->mode == O_WRONLY) {
+        if (lz61_put(f->lz, f->lz->frame, f->lz_pos) < 0) {
+            r = -1;
+        }
+        f->lz_pos = 0;
+        if (io61_flush(f->lz->under) < 0) {
+            r = -1;
+        }
+    }
+    return r;
+}
+
+
+// io61_setchecksum(f, enable)
+//    Start keeping a CRC32C of the data read from or written to `f` from
+//    now on (if `enable` is nonzero), or stop. Returns 0.
+
+int io61_setchecksum(io61_file* f, int enable) {
+    f->checksum = enable;
+    f->crc = 0;
     return 0;
 }
 
 
+// io61_checksum(f)
+//    Return the CRC32C of the data read from or written to `f` since
+//    io61_setchecksum.
+
+uint32_t io61_checksum(io61_file* f) {
+    return f->crc;
+}
+
+
 // io61_seek(f, pos)
 //    Change the file pointer for file `f` to `pos` bytes into the file.
 //    Returns 0 on success and -1 on failure.
 
 int io61_seek(io61_file* f, off_t pos) {
+    f->lend_pos = f->lend_len = 0;
     return fseek(f->f, pos, SEEK_SET);
 }
 
@@ -153,5 +466,17 @@ off_t io61_filesize(io61_file* f) {
 //    immediately after a `read` call that returned 0 or -1.
 
 int io61_eof(io61_file* f) {
-    return feof(f->f);
+    return f->lend_pos == f->lend_len && feof(f->f);
+}
+
+
+// io61_profile_stats(buf, size)
+//    Write io61's counters to `buf` as JSON members. This version keeps
+//    none, so the report is empty.
+
+int io61_profile_stats(char* buf, size_t size) {
+    if (size > 0) {
+        buf[0] = '\0';
+    }
+    return 0;
 }